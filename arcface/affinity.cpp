@@ -0,0 +1,208 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include "cpu.h"
+#include "affinity.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static string readLine(const string& path)
+{
+    string line;
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp)
+        return line;
+    char buf[4096];
+    if (fgets(buf, sizeof(buf), fp))
+        line = buf;
+    fclose(fp);
+    return line;
+}
+
+vector<int> parseCpuList(const string& list)
+{
+    vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size())
+    {
+        size_t end = list.find(',', pos);
+        if (end == string::npos)
+            end = list.size();
+        string item = list.substr(pos, end - pos);
+        int first, last;
+        if (sscanf(item.c_str(), "%d-%d", &first, &last) == 2)
+        {
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        }
+        else if (sscanf(item.c_str(), "%d", &first) == 1)
+        {
+            cpus.push_back(first);
+        }
+        pos = end + 1;
+    }
+    sort(cpus.begin(), cpus.end());
+    cpus.erase(unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+vector<int> onlineCpus()
+{
+    vector<int> cpus = parseCpuList(readLine("/sys/devices/system/cpu/online"));
+    if (cpus.empty())
+    {
+        for (int i = 0; i < ncnn::get_cpu_count(); i++)
+            cpus.push_back(i);
+    }
+    return cpus;
+}
+
+vector<int> physicalCores(const vector<int>& cpus)
+{
+    vector<int> cores;
+    for (auto it = cpus.begin(); it != cpus.end(); it++)
+    {
+        char path[128];
+        sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", *it);
+        vector<int> siblings = parseCpuList(readLine(path));
+        bool taken = false;
+        for (auto s = siblings.begin(); s != siblings.end(); s++)
+            if (find(cores.begin(), cores.end(), *s) != cores.end())
+                taken = true;
+        if (!taken)
+            cores.push_back(*it);
+    }
+    return cores;
+}
+
+vector<int> nodeCpus(int node)
+{
+    char path[128];
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+    return parseCpuList(readLine(path));
+}
+
+int cpuNode(int cpu)
+{
+    vector<int> nodes = parseCpuList(readLine("/sys/devices/system/node/online"));
+    for (auto it = nodes.begin(); it != nodes.end(); it++)
+    {
+        vector<int> cpus = nodeCpus(*it);
+        if (find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+            return *it;
+    }
+    return 0;
+}
+
+int pinThread(const vector<int>& cpus)
+{
+#ifdef __linux__
+    if (cpus.empty())
+        return -1;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (auto it = cpus.begin(); it != cpus.end(); it++)
+        CPU_SET(*it, &mask);
+    // pid 0 is the calling thread
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+int pinOmpThreads(const vector<int>& cpus)
+{
+    if (cpus.empty())
+        return -1;
+    int num_threads = (int)cpus.size();
+    ncnn::set_omp_dynamic(0);
+    ncnn::set_omp_num_threads(num_threads);
+    // the threads the runtime starts later, for a larger team than this one
+    // or in place of threads it let go, inherit the mask of the master, so
+    // the master keeps the whole set instead of one cpu
+    if (pinThread(cpus) != 0)
+        return -1;
+#ifdef _OPENMP
+#if _OPENMP >= 201307
+    // OMP_PROC_BIND and OMP_PLACES place every team the runtime starts
+    if (omp_get_proc_bind() != omp_proc_bind_false)
+        return 0;
+#endif
+    int failed = 0;
+    // libgomp reuses its pooled threads in order, so thread i of a smaller
+    // team is still on cpus[i]
+    #pragma omp parallel num_threads(num_threads) reduction(+:failed)
+    {
+        int i = omp_get_thread_num();
+        vector<int> cpu(1, cpus[i]);
+        if (i > 0 && pinThread(cpu) != 0)
+            failed++;
+    }
+    return failed ? -1 : 0;
+#else
+    return 0;
+#endif
+}
+
+int preferNode(int node)
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    if (node < 0 || node >= 64)
+        return -1;
+    unsigned long nodemask = 1UL << node;
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8) == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+vector<vector<int> > splitByNode(const vector<int>& cpus)
+{
+    vector<vector<int> > groups;
+    vector<int> nodes;
+    for (auto it = cpus.begin(); it != cpus.end(); it++)
+    {
+        int node = cpuNode(*it);
+        size_t g = find(nodes.begin(), nodes.end(), node) - nodes.begin();
+        if (g == nodes.size())
+        {
+            nodes.push_back(node);
+            groups.push_back(vector<int>());
+        }
+        groups[g].push_back(*it);
+    }
+    return groups;
+}
+
+int placeWorker(const Placement& placement)
+{
+    vector<int> cpus = placement.cpus.empty() ? onlineCpus() : placement.cpus;
+    if (placement.avoid_smt)
+        cpus = physicalCores(cpus);
+    if (cpus.empty())
+        return -1;
+
+    if (placement.bind_memory)
+    {
+        // one preferred node cannot serve cpus of several
+        if (splitByNode(cpus).size() > 1)
+            return -1;
+        preferNode(cpuNode(cpus[0]));
+    }
+
+    if (pinOmpThreads(cpus) != 0)
+        return -1;
+    return (int)cpus.size();
+}
@@ -0,0 +1,56 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <vector>
+#include <string>
+
+using namespace std;
+
+// Worker placement for Linux servers. A worker thread is pinned to a list of
+// cpus, its OpenMP team gets one thread per cpu, and its memory policy prefers
+// the NUMA node of those cpus, so the cpus of one worker share a node; a
+// machine is covered by a worker per group of splitByNode(). Because pages
+// land on the node of the thread that first touches them, detectors,
+// embedders and their workspaces should be constructed by the worker after
+// placeWorker() so that weights and scratch memory are node local. All
+// functions return -1 where unsupported.
+struct Placement {
+    vector<int> cpus;       // explicit cpu ids, empty = every online cpu
+    bool avoid_smt = true;  // keep only the first hardware thread of each core
+    bool bind_memory = true;
+};
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+vector<int> parseCpuList(const string& list);
+
+vector<int> onlineCpus();
+
+// drops the smt siblings, keeping the lowest cpu id of every physical core
+vector<int> physicalCores(const vector<int>& cpus);
+
+vector<int> nodeCpus(int node);
+
+// numa node of the cpu, 0 on single node machines
+int cpuNode(int cpu);
+
+// pins the calling thread to the cpu set
+int pinThread(const vector<int>& cpus);
+
+// sizes the calling thread's OpenMP team to the cpu list, keeps the calling
+// thread on the whole list and pins team thread i to cpus[i]. teams of other
+// sizes stay within the list. when OMP_PROC_BIND is set the runtime places
+// the team instead, e.g. OMP_PROC_BIND=close OMP_PLACES=cores
+int pinOmpThreads(const vector<int>& cpus);
+
+// makes the calling thread allocate from the given node first
+int preferNode(int node);
+
+// the cpus grouped by numa node, in the order of their first cpu
+vector<vector<int> > splitByNode(const vector<int>& cpus);
+
+// pins the calling thread and its OpenMP team, binds its memory to the node
+// of the cpus. returns the number of cpus used, -1 when bind_memory is set
+// and the cpus span several nodes
+int placeWorker(const Placement& placement);
+
+#endif
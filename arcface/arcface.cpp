@@ -1,12 +1,18 @@
 #include "arcface.h"
+#include "int8.h"
 
-Arcface::Arcface(string model_folder)
+Arcface::Arcface(string model_folder, bool int8)
 {
-    string param_file = model_folder + "/mobilefacenet.param";
-    string bin_file = model_folder + "/mobilefacenet.bin";
+    string model = int8 ? "/mobilefacenet-int8" : "/mobilefacenet";
+    string param_file = model_folder + model + ".param";
+    string bin_file = model_folder + model + ".bin";
 
-    this->net.load_param(param_file.c_str());
-    this->net.load_model(bin_file.c_str());
+    registerInt8Layers(this->net);
+
+    // batchnorm, input scaling and the BGR to RGB swap are folded into the convolutions
+    this->folded = net.load(param_file, bin_file, 0, 0, true);
+    data = net.resolve("data");
+    fc1 = net.resolve("fc1");
 }
 
 Arcface::~Arcface()
@@ -17,18 +23,54 @@ Arcface::~Arcface()
 vector<float> Arcface::getFeature(ncnn::Mat img)
 {
     vector<float> feature;
-    ncnn::Mat in = resize(img, 112, 112);
-    in = bgr2rgb(in);
-    ncnn::Extractor ex = net.create_extractor();
-    ex.set_light_mode(true);
-    ex.input("data", in);
-    ncnn::Mat out;
-    ex.extract("fc1", out);
+    getFeature(img, feature);
+    return feature;
+}
+
+void Arcface::getFeature(ncnn::Mat img, vector<float> &feature)
+{
+    forward(img, feature, num_threads);
+}
+
+void Arcface::forward(ncnn::Mat img, vector<float> &feature, int num_threads)
+{
+    Workspace& ws = net.threadWorkspace();
+    ws.set_num_threads(num_threads);
+    Arena& arena = frameArena();
+    ArenaScope frame(arena);
+    // the workspace copies the input before any layer writes to it in place
+    ncnn::Mat resized = resize(img, 112, 112, &arena);
+    ncnn::Mat in = folded ? resized : bgr2rgb(resized, &arena);
+    ws.input(data, in);
+    net.forward(ws);
+    const ncnn::Mat& out = ws.extract(fc1);
     feature.resize(this->feature_dim);
     for (int i = 0; i < this->feature_dim; i++)
         feature[i] = out[i];
     normalize(feature);
-    return feature;
+}
+
+void Arcface::getFeatures(const ncnn::Mat& faces, vector<vector<float> > &features)
+{
+    int n = faces.c / 3;
+    features.resize(n);
+    if (threads.lookup(112 * 112) != 1 || n < 2)
+    {
+        for (int i = 0; i < n; i++)
+            getFeature(alignedFace(faces, i), features[i]);
+        return;
+    }
+
+    // every OpenMP thread forwards through its own workspace
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++)
+        forward(alignedFace(faces, i), features[i], 1);
+}
+
+void Arcface::CalibrateThreads()
+{
+    threads.clear();
+    num_threads = threads.calibrate(net, data, 112, 112, 3);
 }
 
 void Arcface::normalize(vector<float> &feature)
@@ -42,9 +84,15 @@ void Arcface::normalize(vector<float> &feature)
 }
 
 ncnn::Mat preprocess(ncnn::Mat img, FaceInfo info)
+{
+    ArenaScope scratch(frameArena());
+    return preprocess(toView(img, frameArena()), info);
+}
+
+// similarity transform from the landmarks to their place in the 112x112 crop
+static void alignTransform(const FaceInfo& info, float* M)
 {
     int image_w = 112; //96 or 112
-    int image_h = 112;
 
     float dst[10] = {30.2946, 65.5318, 48.0252, 33.5493, 62.7299,
                      51.6963, 51.5014, 71.7366, 92.3655, 92.2041};
@@ -60,13 +108,49 @@ ncnn::Mat preprocess(ncnn::Mat img, FaceInfo info)
         src[i + 5] = info.landmark[2 * i + 1];
     }
 
-    float M[6];
     getAffineMatrix(src, dst, M);
+}
+
+ncnn::Mat preprocess(const ImageView& img, FaceInfo info)
+{
+    float M[6];
+    alignTransform(info, M);
+    ncnn::Mat out;
+    warpAffineMatrix(img, out, M, 112, 112);
+    return out;
+}
+
+ncnn::Mat preprocessAll(ncnn::Mat img, const vector<FaceInfo>& faces)
+{
+    ArenaScope scratch(frameArena());
+    return preprocessAll(toView(img, frameArena()), faces);
+}
+
+ncnn::Mat preprocessAll(const ImageView& img, const vector<FaceInfo>& faces)
+{
+    int n = (int)faces.size();
     ncnn::Mat out;
-    warpAffineMatrix(img, out, M, image_w, image_h);
+    if (n == 0 || !img.supported())
+        return out;
+    // 112x112 floats fill whole 16 byte blocks, so the channels are back to back
+    out.create(112, 112, 3 * n);
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++)
+    {
+        float M[6];
+        alignTransform(faces[i], M);
+        ncnn::Mat face = alignedFace(out, i);
+        warpAffineMatrix(img, face, M, 112, 112);
+    }
     return out;
 }
 
+ncnn::Mat alignedFace(const ncnn::Mat& faces, int i)
+{
+    return ncnn::Mat(faces.w, faces.h, 3, (void*)(const float*)faces.channel(3 * i));
+}
+
 float calcSimilar(std::vector<float> feature1, std::vector<float> feature2)
 {
     //assert(feature1.size() == feature2.size());
@@ -6,26 +6,57 @@
 #include <string>
 #include "net.h"
 #include "base.h"
+#include "network.h"
 
 using namespace std;
 
 ncnn::Mat preprocess(ncnn::Mat img, FaceInfo info);
 
+// only the 112x112 crop is converted to float
+ncnn::Mat preprocess(const ImageView& img, FaceInfo info);
+
+// all faces of a frame aligned into one 112x112 Mat of 3 * faces.size()
+// channels, face i in channels 3i to 3i+2. the faces are warped in parallel
+ncnn::Mat preprocessAll(ncnn::Mat img, const vector<FaceInfo>& faces);
+ncnn::Mat preprocessAll(const ImageView& img, const vector<FaceInfo>& faces);
+
+// face i of a preprocessAll() result, sharing its memory
+ncnn::Mat alignedFace(const ncnn::Mat& faces, int i);
+
 float calcSimilar(std::vector<float> feature1, std::vector<float> feature2);
 
 
+// getFeature and getFeatures may run on several threads at once on one
+// instance, each thread forwards through a workspace of its own.
+// CalibrateThreads must not overlap them.
 class Arcface {
 
 public:
-    Arcface(string model_folder = ".");
+    // int8 loads mobilefacenet-int8.param/bin as written by the calibrate tool.
+    // throws runtime_error when the model lacks the data or fc1 blob
+    Arcface(string model_folder = ".", bool int8 = false);
     ~Arcface();
     vector<float> getFeature(ncnn::Mat img);
+    // reuses the capacity of feature, all scratch memory comes from the frame arena
+    void getFeature(ncnn::Mat img, vector<float> &feature);
+    // one feature per face of a preprocessAll() result
+    void getFeatures(const ncnn::Mat& faces, vector<vector<float> > &features);
+    // measures the forward with 1, 2, 4 ... threads and keeps the fastest. when
+    // that is one thread, getFeatures runs the faces in parallel instead
+    void CalibrateThreads();
 
 private:
-    ncnn::Net net;
+    Network net;
+    bool folded;
+    BlobHandle data;
+    BlobHandle fc1;
+    ThreadTable threads;
+    // OpenMP threads of one forward, 0 = the global setting
+    int num_threads = 0;
 
     const int feature_dim = 128;
 
+    void forward(ncnn::Mat img, vector<float> &feature, int num_threads);
     void normalize(vector<float> &feature);
 };
 
@@ -0,0 +1,104 @@
+#include <algorithm>
+#include "arena.h"
+
+Arena::Arena(size_t capacity)
+    : cur(0), sys_allocs(0)
+{
+    chunks.reserve(16);
+    if (capacity > 0)
+        addChunk(capacity);
+}
+
+Arena::~Arena()
+{
+    for (auto it = chunks.begin(); it != chunks.end(); it++)
+        ncnn::fastFree(it->data);
+}
+
+void Arena::addChunk(size_t size)
+{
+    Chunk chunk;
+    chunk.data = (unsigned char*)ncnn::fastMalloc(size);
+    chunk.size = size;
+    chunk.used = 0;
+    chunks.push_back(chunk);
+    sys_allocs++;
+}
+
+void* Arena::alloc(size_t size)
+{
+    size = ncnn::alignSize(size, MALLOC_ALIGN);
+    while (cur < chunks.size())
+    {
+        Chunk& chunk = chunks[cur];
+        if (chunk.used + size <= chunk.size)
+        {
+            void* ptr = chunk.data + chunk.used;
+            chunk.used += size;
+            return ptr;
+        }
+        if (cur + 1 == chunks.size())
+            break;
+        chunks[++cur].used = 0;
+    }
+    size_t grow = chunks.empty() ? 0 : chunks.back().size * 2;
+    addChunk(std::max(std::max(size, grow), (size_t)64 * 1024));
+    cur = chunks.size() - 1;
+    chunks[cur].used = size;
+    return chunks[cur].data;
+}
+
+ncnn::Mat Arena::newMat(int w, int h, int c)
+{
+    size_t cstep = ncnn::alignSize(w * h * sizeof(float), 16) / sizeof(float);
+    void* data = alloc(cstep * c * sizeof(float));
+    return ncnn::Mat(w, h, c, data);
+}
+
+Arena::Mark Arena::mark() const
+{
+    Mark m;
+    m.chunk = cur;
+    m.used = chunks.empty() ? 0 : chunks[cur].used;
+    return m;
+}
+
+void Arena::rewind(Mark m)
+{
+    if (chunks.empty())
+        return;
+    if (m.chunk == 0 && m.used == 0 && chunks.size() > 1)
+    {
+        // the arena is empty again, merge the overflow into a single block
+        size_t total = capacity();
+        for (auto it = chunks.begin(); it != chunks.end(); it++)
+            ncnn::fastFree(it->data);
+        chunks.clear();
+        addChunk(total);
+    }
+    else
+    {
+        chunks[m.chunk].used = m.used;
+    }
+    cur = m.chunk;
+}
+
+void Arena::reset()
+{
+    Mark m = {0, 0};
+    rewind(m);
+}
+
+size_t Arena::capacity() const
+{
+    size_t total = 0;
+    for (auto it = chunks.begin(); it != chunks.end(); it++)
+        total += it->size;
+    return total;
+}
+
+Arena& frameArena()
+{
+    static thread_local Arena arena;
+    return arena;
+}
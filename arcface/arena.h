@@ -0,0 +1,69 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <vector>
+#include "net.h"
+
+// Bump allocator for per-frame scratch memory. Allocations are only released
+// all at once, by rewinding to a mark or by reset(). When a frame needs more
+// than the current capacity, overflow chunks are taken from the system and
+// merged into one block on the next reset, so after warm-up every frame is
+// served from a single block without touching the system allocator.
+class Arena {
+public:
+    struct Mark {
+        size_t chunk;
+        size_t used;
+    };
+
+    Arena(size_t capacity = 0);
+    ~Arena();
+
+    void* alloc(size_t size);
+    template<typename T> T* alloc(size_t count) { return (T*)alloc(count * sizeof(T)); }
+
+    // ncnn::Mat backed by arena memory, valid until the arena is rewound past it.
+    // it carries no refcount, so it cannot be the input of a layer that runs in place
+    ncnn::Mat newMat(int w, int h, int c);
+
+    Mark mark() const;
+    void rewind(Mark m);
+    void reset();
+
+    size_t capacity() const;
+    size_t sysAllocs() const { return sys_allocs; }
+
+private:
+    struct Chunk {
+        unsigned char* data;
+        size_t size;
+        size_t used;
+    };
+    std::vector<Chunk> chunks;
+    size_t cur;
+    size_t sys_allocs;
+
+    void addChunk(size_t size);
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+};
+
+// Releases everything allocated from the arena inside the enclosing scope.
+// The outermost scope of a frame leaves the arena empty, which is where it
+// gets compacted for the next frame.
+class ArenaScope {
+public:
+    ArenaScope(Arena& a) : arena(a), saved(a.mark()) {}
+    ~ArenaScope() { arena.rewind(saved); }
+
+private:
+    Arena& arena;
+    Arena::Mark saved;
+};
+
+// scratch arena of the calling thread
+Arena& frameArena();
+
+#endif
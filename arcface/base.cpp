@@ -1,33 +1,233 @@
+#include <algorithm>
 #include "base.h"
 
-ncnn::Mat resize(ncnn::Mat src, int w, int h)
+using namespace std;
+
+static void pixels2mat(const unsigned char* pixels, ncnn::Mat& dst, bool swap_rb)
+{
+    int size = dst.w * dst.h;
+    float* ptr0 = dst.channel(swap_rb ? 2 : 0);
+    float* ptr1 = dst.channel(1);
+    float* ptr2 = dst.channel(swap_rb ? 0 : 2);
+    for (int i = 0; i < size; i++)
+    {
+        ptr0[i] = pixels[3 * i];
+        ptr1[i] = pixels[3 * i + 1];
+        ptr2[i] = pixels[3 * i + 2];
+    }
+}
+
+static inline unsigned char saturate(int v)
+{
+    return (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+// BGR of one pixel of a YUV view, with the fixed-point BT.601 coefficients of
+// ncnn::yuv420sp2rgb
+static inline void yuvPixel(const ImageView& img, int x, int y, unsigned char* bgr)
+{
+    int Y, u, v;
+    if (img.format == PIXEL_YUYV)
+    {
+        const unsigned char* p = img.data + y * img.stride + (x & ~1) * 2;
+        Y = p[(x & 1) * 2];
+        u = p[1] - 128;
+        v = p[3] - 128;
+    }
+    else
+    {
+        Y = img.data[y * img.stride + x];
+        const unsigned char* p = img.uv + (y >> 1) * img.uv_stride + (x & ~1);
+        u = (img.format == PIXEL_NV12 ? p[0] : p[1]) - 128;
+        v = (img.format == PIXEL_NV12 ? p[1] : p[0]) - 128;
+    }
+    Y <<= 6;
+    bgr[0] = saturate((Y + 113 * u) >> 6);
+    bgr[1] = saturate((Y - 46 * v - 22 * u) >> 6);
+    bgr[2] = saturate((Y + 90 * v) >> 6);
+}
+
+// byte offsets of the B, G and R values within a pixel
+static void channelOffsets(const ImageView& img, int* off)
+{
+    bool bgr = img.format == ncnn::Mat::PIXEL_BGR;
+    off[0] = bgr ? 0 : 2;
+    off[1] = 1;
+    off[2] = bgr ? 2 : 0;
+}
+
+ImageView toView(ncnn::Mat img, Arena& arena)
+{
+    unsigned char* pixels = arena.alloc<unsigned char>(img.w * img.h * 3);
+    // keeps the channel order, which is BGR for Mats made by from_pixels(PIXEL_BGR)
+    img.to_pixels(pixels, ncnn::Mat::PIXEL_RGB);
+    return ImageView(pixels, img.w, img.h, img.w * 3, ncnn::Mat::PIXEL_BGR);
+}
+
+// source indices and 11-bit weights of the two samples for each output
+// coordinate, with the mapping and rounding of ncnn::resize_bilinear_c3
+static void bilinearTable(int begin, int end, int size, int limit, int* index, short* weight)
+{
+    int n = end - begin;
+    double scale = (double)n / size;
+    for (int d = 0; d < size; d++)
+    {
+        float f = (float)((d + 0.5) * scale - 0.5);
+        int s = (int)floor(f);
+        f -= s;
+        if (s < 0)
+        {
+            s = 0;
+            f = 0.f;
+        }
+        if (s >= n - 1)
+        {
+            s = n - 2;
+            f = 1.f;
+        }
+        s += begin;
+        index[2 * d] = min(max(s, 0), limit - 1);
+        index[2 * d + 1] = min(max(s + 1, 0), limit - 1);
+        weight[2 * d] = (short)floor((1.f - f) * 2048 + 0.5f);
+        weight[2 * d + 1] = (short)floor(f * 2048 + 0.5f);
+    }
+}
+
+// The arithmetic is that of resize_bilinear_c3, so the network inputs are the
+// same as those of resize() on a cut of a float Mat.
+ncnn::Mat cropResize(const ImageView& src, int x0, int y0, int x1, int y1, int w, int h,
+                     Arena* arena, const float* mean_vals, const float* norm_vals)
+{
+    if (!src.supported())
+        return ncnn::Mat();
+    ncnn::Mat dst = arena ? arena->newMat(w, h, 3) : ncnn::Mat(w, h, 3);
+    cropResize(src, x0, y0, x1, y1, dst, mean_vals, norm_vals);
+    return dst;
+}
+
+void cropResize(const ImageView& src, int x0, int y0, int x1, int y1, ncnn::Mat& dst,
+                const float* mean_vals, const float* norm_vals)
+{
+    if (!src.supported())
+        return;
+    int w = dst.w;
+    int h = dst.h;
+    int cn = src.channels();
+    int off[3];
+    channelOffsets(src, off);
+
+    ArenaScope scratch(frameArena());
+    int* xofs = frameArena().alloc<int>(2 * w);
+    short* alpha = frameArena().alloc<short>(2 * w);
+    int* yofs = frameArena().alloc<int>(2 * h);
+    short* beta = frameArena().alloc<short>(2 * h);
+    bilinearTable(x0, x1, w, src.w, xofs, alpha);
+    bilinearTable(y0, y1, h, src.h, yofs, beta);
+
+    float mean[3] = {0.f, 0.f, 0.f};
+    float norm[3] = {1.f, 1.f, 1.f};
+    for (int c = 0; c < 3; c++)
+    {
+        if (mean_vals)
+            mean[c] = mean_vals[c];
+        if (norm_vals)
+            norm[c] = norm_vals[c];
+    }
+    bool normalize = mean_vals || norm_vals;
+
+    if (src.yuv())
+    {
+        // only the four source pixels of each sample are converted
+        float* out[3] = {dst.channel(0), dst.channel(1), dst.channel(2)};
+        for (int dy = 0; dy < h; dy++)
+        {
+            short b0 = beta[2 * dy];
+            short b1 = beta[2 * dy + 1];
+            for (int dx = 0; dx < w; dx++)
+            {
+                unsigned char p00[3], p01[3], p10[3], p11[3];
+                yuvPixel(src, xofs[2 * dx], yofs[2 * dy], p00);
+                yuvPixel(src, xofs[2 * dx + 1], yofs[2 * dy], p01);
+                yuvPixel(src, xofs[2 * dx], yofs[2 * dy + 1], p10);
+                yuvPixel(src, xofs[2 * dx + 1], yofs[2 * dy + 1], p11);
+                for (int c = 0; c < 3; c++)
+                {
+                    short top = (short)((p00[c] * alpha[2 * dx] + p01[c] * alpha[2 * dx + 1]) >> 4);
+                    short bottom = (short)((p10[c] * alpha[2 * dx] + p11[c] * alpha[2 * dx + 1]) >> 4);
+                    float v = (unsigned char)(((short)((b0 * top) >> 16) + (short)((b1 * bottom) >> 16) + 2) >> 2);
+                    out[c][dy * w + dx] = normalize ? (v - mean[c]) * norm[c] : v;
+                }
+            }
+        }
+        return;
+    }
+
+    for (int dx = 0; dx < 2 * w; dx++)
+        xofs[dx] *= cn;
+    for (int c = 0; c < 3; c++)
+    {
+        float* out = dst.channel(c);
+        for (int dy = 0; dy < h; dy++)
+        {
+            const unsigned char* row0 = src.data + yofs[2 * dy] * src.stride + off[c];
+            const unsigned char* row1 = src.data + yofs[2 * dy + 1] * src.stride + off[c];
+            short b0 = beta[2 * dy];
+            short b1 = beta[2 * dy + 1];
+            for (int dx = 0; dx < w; dx++)
+            {
+                int i0 = xofs[2 * dx];
+                int i1 = xofs[2 * dx + 1];
+                short top = (short)((row0[i0] * alpha[2 * dx] + row0[i1] * alpha[2 * dx + 1]) >> 4);
+                short bottom = (short)((row1[i0] * alpha[2 * dx] + row1[i1] * alpha[2 * dx + 1]) >> 4);
+                float v = (unsigned char)(((short)((b0 * top) >> 16) + (short)((b1 * bottom) >> 16) + 2) >> 2);
+                out[dx] = normalize ? (v - mean[c]) * norm[c] : v;
+            }
+            out += w;
+        }
+    }
+}
+
+ncnn::Mat resize(ncnn::Mat src, int w, int h, Arena* arena)
 {
     int src_w = src.w;
     int src_h = src.h;
-    unsigned char* u_src = new unsigned char[src_w * src_h * 3];
+    ncnn::Mat dst;
+    if (arena)
+        dst = arena->newMat(w, h, 3);
+
+    ArenaScope scratch(frameArena());
+    unsigned char* u_src = frameArena().alloc<unsigned char>(src_w * src_h * 3);
     src.to_pixels(u_src, ncnn::Mat::PIXEL_RGB);
-    unsigned char* u_dst = new unsigned char[w * h * 3];
+    unsigned char* u_dst = frameArena().alloc<unsigned char>(w * h * 3);
     ncnn::resize_bilinear_c3(u_src, src_w, src_h, u_dst, w, h);
-    ncnn::Mat dst = ncnn::Mat::from_pixels(u_dst, ncnn::Mat::PIXEL_RGB, w, h);
-    delete[] u_src;
-    delete[] u_dst;
+    if (arena)
+        pixels2mat(u_dst, dst, false);
+    else
+        dst = ncnn::Mat::from_pixels(u_dst, ncnn::Mat::PIXEL_RGB, w, h);
     return dst;
 }
 
-ncnn::Mat bgr2rgb(ncnn::Mat src)
+ncnn::Mat bgr2rgb(ncnn::Mat src, Arena* arena)
 {
     int src_w = src.w;
     int src_h = src.h;
-    unsigned char* u_rgb = new unsigned char[src_w * src_h * 3];
-    src.to_pixels(u_rgb, ncnn::Mat::PIXEL_BGR2RGB);
-    ncnn::Mat dst = ncnn::Mat::from_pixels(u_rgb, ncnn::Mat::PIXEL_RGB, src_w, src_h);
-    delete[] u_rgb;
+    ncnn::Mat dst;
+    if (arena)
+        dst = arena->newMat(src_w, src_h, 3);
+
+    ArenaScope scratch(frameArena());
+    unsigned char* u_rgb = frameArena().alloc<unsigned char>(src_w * src_h * 3);
+    src.to_pixels(u_rgb, ncnn::Mat::PIXEL_RGB);
+    if (arena)
+        pixels2mat(u_rgb, dst, true);
+    else
+        dst = ncnn::Mat::from_pixels(u_rgb, ncnn::Mat::PIXEL_BGR2RGB, src_w, src_h);
     return dst;
 }
 
-ncnn::Mat rgb2bgr(ncnn::Mat src)
+ncnn::Mat rgb2bgr(ncnn::Mat src, Arena* arena)
 {
-    return bgr2rgb(src);
+    return bgr2rgb(src, arena);
 }
 
 void getAffineMatrix(float* src_5pts, const float* dst_5pts, float* M)
@@ -143,13 +343,26 @@ void getAffineMatrix(float* src_5pts, const float* dst_5pts, float* M)
 
 void warpAffineMatrix(ncnn::Mat src, ncnn::Mat &dst, float *M, int dst_w, int dst_h)
 {
+    ArenaScope scratch(frameArena());
+    warpAffineMatrix(toView(src, frameArena()), dst, M, dst_w, dst_h);
+}
+
+void warpAffineMatrix(const ImageView& src, ncnn::Mat &dst, float *M, int dst_w, int dst_h)
+{
+    if (!src.supported())
+    {
+        dst = ncnn::Mat();
+        return;
+    }
     int src_w = src.w;
     int src_h = src.h;
+    int cn = src.channels();
+    int off[3];
+    channelOffsets(src, off);
 
-    unsigned char * src_u = new unsigned char[src_w * src_h * 3]{0};
-    unsigned char * dst_u = new unsigned char[dst_w * dst_h * 3]{0};
-    
-    src.to_pixels(src_u, ncnn::Mat::PIXEL_RGB);
+    dst.create(dst_w, dst_h, 3);
+    dst.fill(0.f);
+    float* out[3] = {dst.channel(0), dst.channel(1), dst.channel(2)};
 
     float m[6];
     for (int i = 0; i < 6; i++)
@@ -188,20 +401,33 @@ void warpAffineMatrix(ncnn::Mat src, ncnn::Mat &dst, float *M, int dst_w, int ds
 
             if (sy == src_h - 1 || sx == src_w - 1)
                 continue;
+            if (src.yuv())
+            {
+                unsigned char p00[3], p01[3], p10[3], p11[3];
+                yuvPixel(src, sx, sy, p00);
+                yuvPixel(src, sx + 1, sy, p01);
+                yuvPixel(src, sx, sy + 1, p10);
+                yuvPixel(src, sx + 1, sy + 1, p11);
+                for (int c = 0; c < 3; c++)
+                {
+                    out[c][y * dst_w + x] = (float)((
+                            p00[c] * cbufx[0] * cbufy[0] + p10[c] * cbufx[0] * cbufy[1] +
+                            p01[c] * cbufx[1] * cbufy[0] + p11[c] * cbufx[1] * cbufy[1]
+                        ) >> 22);
+                }
+                continue;
+            }
+            const unsigned char* p0 = src.data + sy * src.stride + sx * cn;
+            const unsigned char* p1 = p0 + src.stride;
             for (int c = 0; c < 3; c++)
             {
-                dst_u[3 * (y * dst_w + x) + c] = 
-                    (
-                        src_u[3 * (sy * src_w + sx) + c] * cbufx[0] * cbufy[0] +
-                        src_u[3 * ((sy + 1) * src_w + sx) + c] * cbufx[0] * cbufy[1] + 
-                        src_u[3 * (sy * src_w + sx + 1) + c] * cbufx[1] * cbufy[0] +
-                        src_u[3 * ((sy + 1) * src_w + sx + 1) + c] * cbufx[1] * cbufy[1]
-                    ) >> 22;
+                out[c][y * dst_w + x] = (float)((
+                        p0[off[c]] * cbufx[0] * cbufy[0] +
+                        p1[off[c]] * cbufx[0] * cbufy[1] +
+                        p0[cn + off[c]] * cbufx[1] * cbufy[0] +
+                        p1[cn + off[c]] * cbufx[1] * cbufy[1]
+                    ) >> 22);
             }
         }
     }
-
-    dst = ncnn::Mat::from_pixels(dst_u, ncnn::Mat::PIXEL_BGR, dst_w, dst_h);
-    delete[] src_u;
-    delete[] dst_u;
 }
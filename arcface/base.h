@@ -3,6 +3,7 @@
 #include <cmath>
 #include <cstring>
 #include "net.h"
+#include "arena.h"
 
 typedef struct FaceInfo {
     float score;
@@ -13,14 +14,76 @@ typedef struct FaceInfo {
     int landmark[10];
 } FaceInfo;
 
-ncnn::Mat resize(ncnn::Mat src, int w, int h);
+// camera formats beside ncnn's pixel types. NV12 and NV21 are a luma plane
+// followed by a half resolution plane of interleaved UV or VU pairs, YUYV
+// packs two pixels as Y0 U Y1 V
+enum {
+    PIXEL_NV12 = 1 << 12,
+    PIXEL_NV21 = 1 << 13,
+    PIXEL_YUYV = 1 << 14,
+};
 
-ncnn::Mat bgr2rgb(ncnn::Mat src);
+// 8-bit pixels owned by the caller, such as a camera frame or cv::Mat::data,
+// used without a copy. format is ncnn::Mat::PIXEL_BGR, PIXEL_RGB, PIXEL_RGBA
+// or one of the YUV formats above, stride the distance between rows in bytes.
+// For NV12 and NV21, uv points to the chroma plane with rows uv_stride apart.
+// Any other format, such as PIXEL_GRAY or a conversion like PIXEL_RGB2BGR, is
+// refused: Detect finds no faces in it, cropResize and warpAffineMatrix
+// return an empty Mat.
+// The float Mats made from a view always have the channels in BGR order, as
+// from_pixels(PIXEL_BGR) makes them; YUV pixels are converted where sampled.
+struct ImageView {
+    const unsigned char* data;
+    int w;
+    int h;
+    int stride;
+    int format;
+    const unsigned char* uv;
+    int uv_stride;
 
-ncnn::Mat rgb2bgr(ncnn::Mat src);
+    ImageView() : data(0), w(0), h(0), stride(0), format(ncnn::Mat::PIXEL_BGR), uv(0), uv_stride(0) {}
+    ImageView(const unsigned char* data, int w, int h, int stride, int format = ncnn::Mat::PIXEL_BGR)
+        : data(data), w(w), h(h), stride(stride), format(format), uv(0), uv_stride(0) {}
+    ImageView(const unsigned char* y, const unsigned char* uv, int w, int h, int y_stride, int uv_stride, int format)
+        : data(y), w(w), h(h), stride(y_stride), format(format), uv(uv), uv_stride(uv_stride) {}
+
+    int channels() const { return format == ncnn::Mat::PIXEL_RGBA ? 4 : 3; }
+    bool yuv() const { return (format & (PIXEL_NV12 | PIXEL_NV21 | PIXEL_YUYV)) != 0; }
+    // one of the formats above, with a chroma plane where it needs one
+    bool supported() const
+    {
+        if (format == PIXEL_NV12 || format == PIXEL_NV21)
+            return uv != 0;
+        return format == ncnn::Mat::PIXEL_BGR || format == ncnn::Mat::PIXEL_RGB ||
+               format == ncnn::Mat::PIXEL_RGBA || format == PIXEL_YUYV;
+    }
+};
+
+// packed BGR pixels of a float Mat made by from_pixels, allocated from the arena
+ImageView toView(ncnn::Mat img, Arena& arena);
+
+// bilinear resize of the region [x0, x1) x [y0, y1) of src to a w x h float Mat,
+// with (v - mean_vals[c]) * norm_vals[c] applied when they are given. samples
+// outside the image repeat its border pixels
+ncnn::Mat cropResize(const ImageView& src, int x0, int y0, int x1, int y1, int w, int h,
+                     Arena* arena = 0, const float* mean_vals = 0, const float* norm_vals = 0);
+
+// the same into the first three channels of dst, which sets the output size.
+// dst is left as it is for a view of a refused format
+void cropResize(const ImageView& src, int x0, int y0, int x1, int y1, ncnn::Mat& dst,
+                const float* mean_vals = 0, const float* norm_vals = 0);
+
+// when an arena is given the result is allocated from it instead of the heap
+ncnn::Mat resize(ncnn::Mat src, int w, int h, Arena* arena = 0);
+
+ncnn::Mat bgr2rgb(ncnn::Mat src, Arena* arena = 0);
+
+ncnn::Mat rgb2bgr(ncnn::Mat src, Arena* arena = 0);
 
 void getAffineMatrix(float* src_5pts, const float* dst_5pts, float* M);
 
 void warpAffineMatrix(ncnn::Mat src, ncnn::Mat &dst, float *M, int dst_w, int dst_h);
 
+void warpAffineMatrix(const ImageView& src, ncnn::Mat &dst, float *M, int dst_w, int dst_h);
+
 #endif
@@ -0,0 +1,1031 @@
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <dirent.h>
+#include <unistd.h>
+#include "benchmark.h"
+#include "affinity.h"
+#include "arcface.h"
+#include "mtcnn.h"
+#include "quality.h"
+#include "synth.h"
+#include "jpegimage.h"
+#include "json.h"
+#include "gallery.h"
+#include "embedcache.h"
+using namespace std;
+
+struct BenchOptions {
+    int warmup = 10;
+    int iters = 100;
+    bool json = false;
+    string filter;
+    string model_folder = "../models";
+    int width = 640;
+    int height = 480;
+    string cpus;
+    bool smt = false;
+    int max_rnet = 0;
+    int max_onet = 0;
+    double budget = 0;
+    bool calibrate = false;
+    // synthetic frame sweep, see synth.h
+    string scaling;
+    string faces = "1,4,16,64";
+    string images = "../image";
+    // regression gate, see runSuite
+    bool suite = false;
+    string baseline;
+    string save_baseline;
+    int retries = 2;
+};
+
+struct BenchResult {
+    string name;
+    string shape;
+    vector<double> times;
+    // extra values reported with the timings, e.g. candidates per stage
+    vector<pair<string, double> > counters;
+};
+
+// deterministic pseudo random numbers, so every run sees the same inputs
+static unsigned int rng_state = 12345;
+static unsigned int rng()
+{
+    rng_state = rng_state * 1103515245 + 12345;
+    return (rng_state >> 16) & 0x7fff;
+}
+
+static float rngf()
+{
+    return rng() / 32767.f;
+}
+
+static ncnn::Mat synthImage(int w, int h)
+{
+    vector<unsigned char> pixels(w * h * 3);
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+            for (int c = 0; c < 3; c++)
+                pixels[3 * (y * w + x) + c] = (unsigned char)((x * (c + 1) + y * (3 - c)) / 4 + rng() % 32);
+    return ncnn::Mat::from_pixels(pixels.data(), ncnn::Mat::PIXEL_BGR, w, h);
+}
+
+static ncnn::Mat synthTensor(int w, int h, int c)
+{
+    ncnn::Mat m(w, h, c);
+    for (int q = 0; q < c; q++)
+    {
+        float* ptr = m.channel(q);
+        for (int i = 0; i < w * h; i++)
+            ptr[i] = rngf() * 2.f - 1.f;
+    }
+    return m;
+}
+
+static FaceInfo synthFace(int img_w, int img_h)
+{
+    FaceInfo info;
+    int size = 40 + rng() % (min(img_w, img_h) / 2);
+    info.x[0] = rng() % (img_w - size);
+    info.y[0] = rng() % (img_h - size);
+    info.x[1] = info.x[0] + size;
+    info.y[1] = info.y[0] + size;
+    info.score = rngf();
+    info.area = (float)size * size;
+    for (int c = 0; c < 4; c++)
+        info.regreCoord[c] = (rngf() - 0.5f) * 0.2f;
+    const float pts[10] = {0.3f, 0.3f, 0.7f, 0.3f, 0.5f, 0.5f, 0.35f, 0.75f, 0.65f, 0.75f};
+    for (int p = 0; p < 5; p++)
+    {
+        info.landmark[2 * p] = info.x[0] + (int)(pts[2 * p] * size);
+        info.landmark[2 * p + 1] = info.y[0] + (int)(pts[2 * p + 1] * size);
+    }
+    return info;
+}
+
+// a normalized feature, as getFeature returns them
+static vector<float> synthFeature(int dim)
+{
+    vector<float> feature(dim);
+    float norm = 0;
+    for (int i = 0; i < dim; i++)
+    {
+        feature[i] = rngf() * 2.f - 1.f;
+        norm += feature[i] * feature[i];
+    }
+    norm = sqrt(norm);
+    for (int i = 0; i < dim; i++)
+        feature[i] /= norm;
+    return feature;
+}
+
+// dir and the files in it
+static void removeDirectory(const string& dir)
+{
+    DIR* d = opendir(dir.c_str());
+    if (d)
+    {
+        for (dirent* e = readdir(d); e; e = readdir(d))
+            if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+                unlink((dir + "/" + e->d_name).c_str());
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+}
+
+static BenchResult runBench(const BenchOptions& opt, const string& name, const string& shape,
+                            function<void()> setup, function<void()> fn)
+{
+    BenchResult result;
+    result.name = name;
+    result.shape = shape;
+    for (int i = 0; i < opt.warmup; i++)
+    {
+        setup();
+        fn();
+    }
+    result.times.reserve(opt.iters);
+    for (int i = 0; i < opt.iters; i++)
+    {
+        setup();
+        double start = ncnn::get_current_time();
+        fn();
+        result.times.push_back(ncnn::get_current_time() - start);
+    }
+    return result;
+}
+
+static double percentile(const vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    int index = (int)ceil(p / 100.0 * sorted.size()) - 1;
+    index = max(0, min((int)sorted.size() - 1, index));
+    return sorted[index];
+}
+
+struct BenchStats {
+    double mean, stddev, min, p50, p90, p99, max;
+};
+
+static BenchStats calcStats(vector<double> times)
+{
+    BenchStats s = {0, 0, 0, 0, 0, 0, 0};
+    if (times.empty())
+        return s;
+    sort(times.begin(), times.end());
+    for (auto it = times.begin(); it != times.end(); it++)
+        s.mean += *it;
+    s.mean /= times.size();
+    for (auto it = times.begin(); it != times.end(); it++)
+        s.stddev += (*it - s.mean) * (*it - s.mean);
+    s.stddev = sqrt(s.stddev / times.size());
+    s.min = times.front();
+    s.p50 = percentile(times, 50);
+    s.p90 = percentile(times, 90);
+    s.p99 = percentile(times, 99);
+    s.max = times.back();
+    return s;
+}
+
+static void printTable(const vector<BenchResult>& results)
+{
+    printf("%-20s %-20s %6s %10s %10s %10s %10s %10s %10s\n",
+           "stage", "shape", "iters", "mean", "min", "p50", "p90", "p99", "max");
+    for (auto it = results.begin(); it != results.end(); it++)
+    {
+        BenchStats s = calcStats(it->times);
+        printf("%-20s %-20s %6d %10.4f %10.4f %10.4f %10.4f %10.4f %10.4f",
+               it->name.c_str(), it->shape.c_str(), (int)it->times.size(),
+               s.mean, s.min, s.p50, s.p90, s.p99, s.max);
+        for (auto c = it->counters.begin(); c != it->counters.end(); c++)
+            printf(" %s=%g", c->first.c_str(), c->second);
+        printf("\n");
+    }
+    printf("all times in ms\n");
+}
+
+// extra holds more top level members, each starting with ",\n"
+static void printJson(FILE* fp, const BenchOptions& opt, const vector<BenchResult>& results, const string& extra = "")
+{
+    fprintf(fp, "{\n  \"warmup\": %d,\n  \"iters\": %d,\n  \"unit\": \"ms\",\n  \"results\": [\n", opt.warmup, opt.iters);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        BenchStats s = calcStats(results[i].times);
+        fprintf(fp, "    {\"name\": \"%s\", \"shape\": \"%s\", \"iters\": %d, \"mean\": %.6f, \"stddev\": %.6f, "
+               "\"min\": %.6f, \"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f",
+               results[i].name.c_str(), results[i].shape.c_str(), (int)results[i].times.size(),
+               s.mean, s.stddev, s.min, s.p50, s.p90, s.p99, s.max);
+        for (auto c = results[i].counters.begin(); c != results[i].counters.end(); c++)
+            fprintf(fp, ", \"%s\": %g", c->first.c_str(), c->second);
+        fprintf(fp, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]%s\n}\n", extra.c_str());
+}
+
+// the photos that ship in ../image
+static const int BUNDLED_IMAGES = 4;
+static const char* bundled_images[BUNDLED_IMAGES] = {"fbb1.jpeg", "fbb2.jpeg", "gyy1.jpeg", "gyy2.jpeg"};
+
+struct SuiteFace {
+    string image;
+    FaceInfo info;
+    vector<float> feature;
+};
+
+// the fixed suite of the regression gate: detection, alignment and embedding
+// of every bundled photo, timed, with the faces and features they produce.
+// shapes are the file names so that the metrics keep their names when the
+// number of faces changes
+static bool runSuite(const BenchOptions& opt, vector<BenchResult>& results, vector<SuiteFace>& faces)
+{
+    MtcnnDetector detector(opt.model_folder);
+    Arcface arc(opt.model_folder);
+    if (opt.calibrate)
+        arc.CalibrateThreads();
+    auto noSetup = []() {};
+    JpegImage jpeg;
+    for (int i = 0; i < BUNDLED_IMAGES; i++)
+    {
+        string name = bundled_images[i];
+        ncnn::Mat img;
+        if (jpeg.open(opt.images + "/" + name))
+            img = jpeg.decode();
+        if (img.empty())
+        {
+            fprintf(stderr, "cannot decode %s/%s\n", opt.images.c_str(), name.c_str());
+            return false;
+        }
+        vector<FaceInfo> found;
+        results.push_back(runBench(opt, "Detect", name, noSetup, [&]() { found = detector.Detect(img); }));
+        if (found.empty())
+            continue;
+        ncnn::Mat crops;
+        results.push_back(runBench(opt, "preprocessAll", name, noSetup, [&]() { crops = preprocessAll(img, found); }));
+        vector<vector<float> > features;
+        results.push_back(runBench(opt, "getFeatures", name, noSetup, [&]() { arc.getFeatures(crops, features); }));
+        for (size_t f = 0; f < found.size(); f++)
+        {
+            SuiteFace face;
+            face.image = name;
+            face.info = found[f];
+            face.feature = features[f];
+            faces.push_back(face);
+        }
+    }
+    return true;
+}
+
+// the "faces" member of the suite output
+static string facesJson(const vector<SuiteFace>& faces)
+{
+    string out = ",\n  \"faces\": [";
+    char buf[64];
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        const FaceInfo& f = faces[i].info;
+        sprintf(buf, "%.6f", f.score);
+        out += string(i ? "," : "") + "\n    {\"image\": \"" + faces[i].image + "\", \"score\": " + buf;
+        sprintf(buf, "[%d, %d, %d, %d]", f.x[0], f.y[0], f.x[1], f.y[1]);
+        out += string(", \"box\": ") + buf + ", \"landmarks\": [";
+        for (int k = 0; k < 10; k++)
+            out += (k ? ", " : "") + to_string(f.landmark[k]);
+        out += "],\n     \"feature\": [";
+        for (size_t k = 0; k < faces[i].feature.size(); k++)
+        {
+            sprintf(buf, "%s%.6f", k ? ", " : "", faces[i].feature[k]);
+            out += buf;
+        }
+        out += "]}";
+    }
+    return out + (faces.empty() ? "]" : "\n  ]");
+}
+
+// times are allowed to grow by a fraction of the baseline p50 plus an
+// absolute slack for the short stages; results by a few pixels of boxes and
+// landmarks, a little score and a minimum cosine similarity of the features
+static string defaultTolerances()
+{
+    return ",\n  \"tolerances\": {\n"
+           "    \"time\": {\"default\": 0.15, \"min_ms\": 0.1},\n"
+           "    \"box\": 1, \"landmark\": 1, \"score\": 0.001, \"similarity\": 0.999\n  }";
+}
+
+// the tolerances of a baseline written back out
+static string tolerancesJson(const JsonValue& tolerances)
+{
+    string out = ",\n  \"tolerances\": {";
+    char buf[64];
+    for (size_t i = 0; i < tolerances.members.size(); i++)
+    {
+        const pair<string, JsonValue>& m = tolerances.members[i];
+        out += string(i ? "," : "") + "\n    \"" + m.first + "\": ";
+        if (m.second.type == JsonValue::OBJECT)
+        {
+            out += "{";
+            for (size_t j = 0; j < m.second.members.size(); j++)
+            {
+                sprintf(buf, "%g", m.second.members[j].second.number);
+                out += string(j ? ", " : "") + "\"" + m.second.members[j].first + "\": " + buf;
+            }
+            out += "}";
+        }
+        else
+        {
+            sprintf(buf, "%g", m.second.number);
+            out += buf;
+        }
+    }
+    return out + "\n  }";
+}
+
+static int maxDistance(const int* a, const int* b, int n)
+{
+    int d = 0;
+    for (int i = 0; i < n; i++)
+        d = max(d, abs(a[i] - b[i]));
+    return d;
+}
+
+// p50 against the baseline's p50 of every metric. a metric fails when it is
+// missing or slower than the baseline by more than its stage's tolerance, a
+// fraction, plus min_ms for the short stages. returns the failures, prints
+// the comparison when print is set
+static int timingFailures(const JsonValue& baseline, const vector<BenchResult>& results, bool print)
+{
+    JsonValue none;
+    const JsonValue* tolerances = baseline.find("tolerances");
+    const JsonValue* time = tolerances ? tolerances->find("time") : 0;
+    if (!time)
+        time = &none;
+    double default_time = time->numberOr("default", 0.15);
+    double min_ms = time->numberOr("min_ms", 0.1);
+    int failures = 0;
+
+    if (print)
+        fprintf(stderr, "%-20s %-20s %10s %10s %8s %8s\n", "stage", "shape", "base p50", "p50", "change", "limit");
+    const JsonValue* base_results = baseline.find("results");
+    for (size_t i = 0; base_results && i < base_results->items.size(); i++)
+    {
+        const JsonValue& b = base_results->items[i];
+        const JsonValue* name = b.find("name");
+        const JsonValue* shape = b.find("shape");
+        if (!name || !shape)
+            continue;
+        double base = b.numberOr("p50", 0);
+        const BenchResult* current = 0;
+        for (auto r = results.begin(); r != results.end() && !current; r++)
+            if (r->name == name->text && r->shape == shape->text)
+                current = &*r;
+        if (!current)
+        {
+            if (print)
+                fprintf(stderr, "%-20s %-20s %10.3f %10s  MISSING\n", name->text.c_str(), shape->text.c_str(), base, "-");
+            failures++;
+            continue;
+        }
+        double p50 = calcStats(current->times).p50;
+        double limit = base * (1 + time->numberOr(name->text, default_time)) + min_ms;
+        bool slow = p50 > limit;
+        if (print)
+            fprintf(stderr, "%-20s %-20s %10.3f %10.3f %+7.1f%% %+7.1f%%%s\n", name->text.c_str(), shape->text.c_str(),
+                    base, p50, base > 0 ? (p50 / base - 1) * 100 : 0, base > 0 ? (limit / base - 1) * 100 : 0,
+                    slow ? "  REGRESSION" : "");
+        failures += slow;
+    }
+    return failures;
+}
+
+// prints every metric and face against the baseline, returns the number of
+// regressions: the timing failures, and faces that are missing, extra or
+// moved beyond the result tolerances
+static int compareBaseline(const JsonValue& baseline, const vector<BenchResult>& results, const vector<SuiteFace>& faces)
+{
+    JsonValue none;
+    const JsonValue* tolerances = baseline.find("tolerances");
+    if (!tolerances)
+        tolerances = &none;
+    int failures = timingFailures(baseline, results, true);
+
+    int box_tol = (int)tolerances->numberOr("box", 1);
+    int landmark_tol = (int)tolerances->numberOr("landmark", 1);
+    double score_tol = tolerances->numberOr("score", 0.001);
+    double similarity_tol = tolerances->numberOr("similarity", 0.999);
+    const JsonValue* base_faces = baseline.find("faces");
+    vector<bool> used(faces.size(), false);
+    int checked = 0;
+    for (size_t i = 0; base_faces && i < base_faces->items.size(); i++)
+    {
+        const JsonValue& b = base_faces->items[i];
+        const JsonValue* image = b.find("image");
+        const JsonValue* box = b.find("box");
+        const JsonValue* landmarks = b.find("landmarks");
+        const JsonValue* feature = b.find("feature");
+        if (!image || !box || box->items.size() != 4 || !landmarks || landmarks->items.size() != 10 || !feature)
+        {
+            fprintf(stderr, "face %d of the baseline is malformed\n", (int)i);
+            failures++;
+            continue;
+        }
+        int base_box[4], base_landmarks[10];
+        for (int k = 0; k < 4; k++)
+            base_box[k] = (int)box->items[k].number;
+        for (int k = 0; k < 10; k++)
+            base_landmarks[k] = (int)landmarks->items[k].number;
+
+        // the closest face of the same image that is not taken yet
+        int best = -1;
+        int best_distance = 0;
+        for (size_t f = 0; f < faces.size(); f++)
+        {
+            if (used[f] || faces[f].image != image->text)
+                continue;
+            int current_box[4] = {faces[f].info.x[0], faces[f].info.y[0], faces[f].info.x[1], faces[f].info.y[1]};
+            int d = maxDistance(base_box, current_box, 4);
+            if (best < 0 || d < best_distance)
+            {
+                best = f;
+                best_distance = d;
+            }
+        }
+        if (best < 0)
+        {
+            fprintf(stderr, "%s: face at %d,%d no longer detected\n", image->text.c_str(), base_box[0], base_box[1]);
+            failures++;
+            continue;
+        }
+        used[best] = true;
+        checked++;
+        const SuiteFace& face = faces[best];
+        int landmark_distance = maxDistance(base_landmarks, face.info.landmark, 10);
+        double score_diff = fabs(face.info.score - b.numberOr("score", 0));
+        // cosine, the baseline was rounded when it was written
+        double similarity = 0, base_norm = 0, norm = 0;
+        if (feature->items.size() == face.feature.size())
+            for (size_t k = 0; k < face.feature.size(); k++)
+            {
+                similarity += feature->items[k].number * face.feature[k];
+                base_norm += feature->items[k].number * feature->items[k].number;
+                norm += face.feature[k] * face.feature[k];
+            }
+        if (base_norm > 0 && norm > 0)
+            similarity /= sqrt(base_norm * norm);
+        if (best_distance > box_tol || landmark_distance > landmark_tol || score_diff > score_tol ||
+            similarity < similarity_tol)
+        {
+            fprintf(stderr, "%s: face at %d,%d changed: box %d px, landmarks %d px, score %.4f, similarity %.4f\n",
+                    image->text.c_str(), base_box[0], base_box[1], best_distance, landmark_distance,
+                    score_diff, similarity);
+            failures++;
+        }
+    }
+    for (size_t f = 0; f < faces.size(); f++)
+    {
+        if (used[f])
+            continue;
+        fprintf(stderr, "%s: new face at %d,%d\n", faces[f].image.c_str(), faces[f].info.x[0], faces[f].info.y[0]);
+        failures++;
+    }
+    fprintf(stderr, "%d faces match the baseline, %d regressions\n", checked, failures);
+    return failures;
+}
+
+// --suite: runs the suite, prints it, writes it as a new baseline and checks
+// it against the old one. returns 1 on a regression
+static int runGate(const BenchOptions& opt)
+{
+    JsonValue baseline;
+    string error;
+    if (!opt.baseline.empty() && !loadJson(opt.baseline, baseline, error))
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        return -1;
+    }
+    vector<BenchResult> results;
+    vector<SuiteFace> faces;
+    if (!runSuite(opt, results, faces))
+        return -1;
+    // a slow metric is measured again before it counts, each keeps its best
+    // run, so that a burst of load on the machine does not fail the gate
+    for (int retry = 0; retry < opt.retries && !opt.baseline.empty(); retry++)
+    {
+        int slow = timingFailures(baseline, results, false);
+        if (slow == 0)
+            break;
+        fprintf(stderr, "%d metrics over their limit, measuring again\n", slow);
+        vector<BenchResult> again;
+        vector<SuiteFace> unused;
+        if (!runSuite(opt, again, unused))
+            return -1;
+        for (auto r = results.begin(); r != results.end(); r++)
+            for (auto a = again.begin(); a != again.end(); a++)
+                if (a->name == r->name && a->shape == r->shape && calcStats(a->times).p50 < calcStats(r->times).p50)
+                    r->times = a->times;
+    }
+    if (opt.json)
+        printJson(stdout, opt, results, facesJson(faces));
+    else
+        printTable(results);
+
+    if (!opt.save_baseline.empty())
+    {
+        // a new baseline keeps the tolerances of the old one
+        const JsonValue* tolerances = baseline.find("tolerances");
+        FILE* fp = fopen(opt.save_baseline.c_str(), "w");
+        if (!fp)
+        {
+            fprintf(stderr, "cannot write %s\n", opt.save_baseline.c_str());
+            return -1;
+        }
+        printJson(fp, opt, results, facesJson(faces) + (tolerances ? tolerancesJson(*tolerances) : defaultTolerances()));
+        fclose(fp);
+    }
+    if (opt.baseline.empty())
+        return 0;
+    return compareBaseline(baseline, results, faces) ? 1 : 0;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--warmup N] [--iters N] [--json] [--filter NAME] [--models DIR] [--size WxH] [--cpus LIST] [--smt]\n"
+            "       [--caps RNET,ONET] [--budget MS] [--calibrate] [--scaling WxH,... [--faces N,...] [--images DIR]]\n"
+            "       %s --suite [--baseline FILE [--retries N]] [--save-baseline FILE] [--images DIR] [--warmup N] [--iters N] [--json]\n",
+            prog, prog);
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions opt;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--json")
+            opt.json = true;
+        else if (arg == "--warmup" && i + 1 < argc)
+            opt.warmup = atoi(argv[++i]);
+        else if (arg == "--iters" && i + 1 < argc)
+            opt.iters = atoi(argv[++i]);
+        else if (arg == "--filter" && i + 1 < argc)
+            opt.filter = argv[++i];
+        else if (arg == "--models" && i + 1 < argc)
+            opt.model_folder = argv[++i];
+        else if (arg == "--cpus" && i + 1 < argc)
+            opt.cpus = argv[++i];
+        else if (arg == "--smt")
+            opt.smt = true;
+        else if (arg == "--calibrate")
+            opt.calibrate = true;
+        else if (arg == "--suite")
+            opt.suite = true;
+        else if (arg == "--baseline" && i + 1 < argc)
+            opt.baseline = argv[++i];
+        else if (arg == "--save-baseline" && i + 1 < argc)
+            opt.save_baseline = argv[++i];
+        else if (arg == "--retries" && i + 1 < argc)
+            opt.retries = atoi(argv[++i]);
+        else if (arg == "--scaling" && i + 1 < argc)
+            opt.scaling = argv[++i];
+        else if (arg == "--faces" && i + 1 < argc)
+            opt.faces = argv[++i];
+        else if (arg == "--images" && i + 1 < argc)
+            opt.images = argv[++i];
+        else if (arg == "--budget" && i + 1 < argc)
+            opt.budget = atof(argv[++i]);
+        else if (arg == "--caps" && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%d,%d", &opt.max_rnet, &opt.max_onet) != 2)
+            {
+                usage(argv[0]);
+                return -1;
+            }
+        }
+        else if (arg == "--size" && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d", &opt.width, &opt.height) != 2)
+            {
+                usage(argv[0]);
+                return -1;
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    vector<pair<int, int> > scaling_sizes;
+    vector<int> scaling_faces;
+    if (opt.iters <= 0 || opt.width < 64 || opt.height < 64 ||
+        (!opt.scaling.empty() && (!parseSizeList(opt.scaling, scaling_sizes) || !parseIntList(opt.faces, scaling_faces))))
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (!opt.cpus.empty())
+    {
+        Placement placement;
+        placement.cpus = parseCpuList(opt.cpus);
+        placement.avoid_smt = !opt.smt;
+        if (placeWorker(placement) <= 0)
+        {
+            if (splitByNode(placement.cpus).size() > 1)
+                fprintf(stderr, "cpus %s span several numa nodes\n", opt.cpus.c_str());
+            else
+                fprintf(stderr, "failed to pin to cpus %s\n", opt.cpus.c_str());
+            return -1;
+        }
+    }
+
+    if (opt.suite)
+        return runGate(opt);
+
+    vector<BenchResult> results;
+    auto wanted = [&](const string& name) {
+        return opt.filter.empty() || name.find(opt.filter) != string::npos;
+    };
+    auto noSetup = []() {};
+    char shape[64];
+
+    int img_w = opt.width;
+    int img_h = opt.height;
+    ncnn::Mat img = synthImage(img_w, img_h);
+    sprintf(shape, "%dx%d", img_w, img_h);
+    string img_shape = shape;
+
+    // first pnet pyramid level for the default minsize of 20
+    int pnet_w = (int)ceil(img_w * 12.0 / 20);
+    int pnet_h = (int)ceil(img_h * 12.0 / 20);
+
+    if (wanted("resize"))
+    {
+        sprintf(shape, "%dx%d", pnet_w, pnet_h);
+        results.push_back(runBench(opt, "resize", img_shape + "->" + shape, noSetup,
+                                   [&]() { ncnn::Mat out = resize(img, pnet_w, pnet_h); }));
+    }
+
+    if (wanted("bgr2rgb"))
+    {
+        results.push_back(runBench(opt, "bgr2rgb", img_shape, noSetup,
+                                   [&]() { ncnn::Mat out = bgr2rgb(img); }));
+    }
+
+    const float dst_5pts[10] = {38.2946, 73.5318, 56.0252, 41.5493, 70.7299,
+                                51.6963, 51.5014, 71.7366, 92.3655, 92.2041};
+    FaceInfo face = synthFace(img_w, img_h);
+    float src_5pts[10];
+    for (int i = 0; i < 5; i++)
+    {
+        src_5pts[i] = face.landmark[2 * i];
+        src_5pts[i + 5] = face.landmark[2 * i + 1];
+    }
+    float M[6];
+    getAffineMatrix(src_5pts, dst_5pts, M);
+
+    if (wanted("getAffineMatrix"))
+    {
+        results.push_back(runBench(opt, "getAffineMatrix", "5pts", noSetup,
+                                   [&]() { getAffineMatrix(src_5pts, dst_5pts, M); }));
+    }
+
+    if (wanted("warpAffineMatrix"))
+    {
+        results.push_back(runBench(opt, "warpAffineMatrix", img_shape + "->112x112", noSetup,
+                                   [&]() { ncnn::Mat out; warpAffineMatrix(img, out, M, 112, 112); }));
+    }
+
+    MtcnnDetector detector(opt.model_folder);
+    detector.SetCandidateLimits(opt.max_rnet, opt.max_onet);
+    detector.SetTimeBudget(opt.budget);
+    if (opt.calibrate)
+        detector.CalibrateThreads(img_w, img_h);
+
+    // pnet output map of the first pyramid level, with a few percent of cells above threshold
+    int map_w = (pnet_w - 10) / 2 + 1;
+    int map_h = (pnet_h - 10) / 2 + 1;
+    ncnn::Mat score(map_w, map_h, 2);
+    ncnn::Mat loc = synthTensor(map_w, map_h, 4);
+    for (int i = 0; i < map_w * map_h; i++)
+    {
+        float p = rngf() < 0.05f ? 0.6f + rngf() * 0.4f : rngf() * 0.6f;
+        score.channel(1)[i] = p;
+        score.channel(0)[i] = 1.f - p;
+    }
+
+    vector<FaceInfo> work;
+    if (wanted("generateBbox"))
+    {
+        sprintf(shape, "%dx%d", map_w, map_h);
+        results.push_back(runBench(opt, "generateBbox", shape, noSetup,
+                                   [&]() { work.clear(); detector.generateBbox(score, loc, 12.f / 20, 0.6f, work); }));
+    }
+
+    vector<FaceInfo> boxes;
+    detector.generateBbox(score, loc, 12.f / 20, 0.6f, boxes);
+    sprintf(shape, "%d boxes", (int)boxes.size());
+    string boxes_shape = shape;
+
+    if (wanted("doNms"))
+    {
+        results.push_back(runBench(opt, "doNms", boxes_shape, [&]() { work = boxes; },
+                                   [&]() { detector.doNms(work, 0.7, "union"); }));
+    }
+
+    if (wanted("refine"))
+    {
+        results.push_back(runBench(opt, "refine", boxes_shape, [&]() { work = boxes; },
+                                   [&]() { detector.refine(work, img_h, img_w, true); }));
+    }
+
+    struct NetCase {
+        const char* name;
+        const char* file;
+        int w, h, c;
+        vector<const char*> outputs;
+    };
+    vector<NetCase> nets = {
+        {"pnet", "det1", pnet_w, pnet_h, 3, {"prob1", "conv4_2"}},
+        {"pnet", "det1", 12, 12, 3, {"prob1", "conv4_2"}},
+        {"rnet", "det2", 24, 24, 3, {"prob1", "conv5_2"}},
+        {"onet", "det3", 48, 48, 3, {"prob1", "conv6_2", "conv6_3"}},
+        {"lnet", "det4", 24, 24, 15, {"fc5_1", "fc5_2", "fc5_3", "fc5_4", "fc5_5"}},
+    };
+    for (auto it = nets.begin(); it != nets.end(); it++)
+    {
+        if (!wanted(it->name))
+            continue;
+        Network net;
+        string param_file = opt.model_folder + "/" + it->file + ".param";
+        string bin_file = opt.model_folder + "/" + it->file + ".bin";
+        net.load(param_file, bin_file, 0, 0, false);
+        BlobHandle data = net.resolve("data");
+        vector<BlobHandle> outputs;
+        for (auto o = it->outputs.begin(); o != it->outputs.end(); o++)
+            outputs.push_back(net.resolve(*o));
+        ncnn::Mat in = synthTensor(it->w, it->h, it->c);
+        sprintf(shape, "%dx%dx%d", it->w, it->h, it->c);
+        results.push_back(runBench(opt, it->name, shape, noSetup, [&]() {
+            ncnn::Extractor ex = net.create_extractor();
+            ex.set_light_mode(true);
+            ex.input(data.index, in);
+            ncnn::Mat out;
+            for (auto o = outputs.begin(); o != outputs.end(); o++)
+                ex.extract(o->index, out);
+        }));
+    }
+
+    if (wanted("Detect"))
+    {
+        results.push_back(runBench(opt, "Detect", img_shape, noSetup,
+                                   [&]() { detector.Detect(img); }));
+    }
+
+    if (wanted("Detect-view"))
+    {
+        // the same frame as 8-bit pixels used in place
+        vector<unsigned char> pixels(img_w * img_h * 3);
+        img.to_pixels(pixels.data(), ncnn::Mat::PIXEL_RGB);
+        ImageView view(pixels.data(), img_w, img_h, img_w * 3);
+        results.push_back(runBench(opt, "Detect-view", img_shape, noSetup,
+                                   [&]() { detector.Detect(view); }));
+    }
+
+    if (wanted("Detect-nv12"))
+    {
+        // a camera frame: the green channel as luma, neutral chroma
+        vector<unsigned char> pixels(img_w * img_h * 3);
+        img.to_pixels(pixels.data(), ncnn::Mat::PIXEL_RGB);
+        vector<unsigned char> luma(img_w * img_h);
+        vector<unsigned char> chroma(img_w * ((img_h + 1) / 2), 128);
+        for (int i = 0; i < img_w * img_h; i++)
+            luma[i] = pixels[3 * i + 1];
+        ImageView view(luma.data(), chroma.data(), img_w, img_h, img_w, img_w, PIXEL_NV12);
+        results.push_back(runBench(opt, "Detect-nv12", img_shape, noSetup,
+                                   [&]() { detector.Detect(view); }));
+    }
+
+    if (!scaling_sizes.empty() && wanted("Detect-synth"))
+    {
+        // Detect against frame size and face count, on frames of the bundled
+        // faces. the counters are those of the last timed run
+        vector<string> paths;
+        for (int i = 0; i < BUNDLED_IMAGES; i++)
+            paths.push_back(opt.images + "/" + bundled_images[i]);
+        vector<FaceSource> sources = loadFaceSources(detector, paths);
+        if (sources.empty())
+            fprintf(stderr, "no faces in %s, skipping Detect-synth\n", opt.images.c_str());
+        for (auto size = scaling_sizes.begin(); size != scaling_sizes.end() && !sources.empty(); size++)
+        {
+            for (auto count = scaling_faces.begin(); count != scaling_faces.end(); count++)
+            {
+                FrameSpec spec;
+                spec.width = size->first;
+                spec.height = size->second;
+                spec.faces = *count;
+                vector<FaceInfo> truth;
+                vector<unsigned char> pixels = composeFrame(sources, spec, truth);
+                ImageView view(pixels.data(), spec.width, spec.height, spec.width * 3);
+                vector<FaceInfo> found;
+                DetectStats stats;
+                sprintf(shape, "%dx%d/%df", spec.width, spec.height, spec.faces);
+                BenchResult result = runBench(opt, "Detect-synth", shape, noSetup,
+                                              [&]() { detector.Detect(view, found, &stats); });
+                int matched = matchFaces(truth, found);
+                result.counters.push_back(make_pair("megapixels", spec.width * (double)spec.height / 1e6));
+                result.counters.push_back(make_pair("faces", (double)truth.size()));
+                result.counters.push_back(make_pair("pnet", (double)stats.pnet));
+                result.counters.push_back(make_pair("rnet", (double)stats.rnet));
+                result.counters.push_back(make_pair("onet", (double)stats.onet));
+                result.counters.push_back(make_pair("pnet_ms", stats.pnet_ms));
+                result.counters.push_back(make_pair("rnet_ms", stats.rnet_ms));
+                result.counters.push_back(make_pair("onet_ms", stats.onet_ms));
+                result.counters.push_back(make_pair("found", (double)found.size()));
+                result.counters.push_back(make_pair("recall", truth.empty() ? 1.0 : (double)matched / truth.size()));
+                results.push_back(result);
+            }
+        }
+    }
+
+    if (wanted("preprocess") || wanted("preprocessAll") || wanted("quality") || wanted("getFeature") || wanted("getFeature-int8")
+        || wanted("getFeatures"))
+    {
+        ncnn::Mat aligned = preprocess(img, face);
+        if (wanted("preprocess"))
+        {
+            results.push_back(runBench(opt, "preprocess", img_shape + "->112x112", noSetup,
+                                       [&]() { preprocess(img, face); }));
+        }
+        vector<FaceInfo> crowd;
+        for (int i = 0; i < 16; i++)
+            crowd.push_back(synthFace(img_w, img_h));
+        if (wanted("preprocessAll"))
+        {
+            results.push_back(runBench(opt, "preprocessAll", img_shape + "->16x112x112", noSetup,
+                                       [&]() { preprocessAll(img, crowd); }));
+        }
+        if (wanted("quality"))
+        {
+            QualityGate gate;
+            FaceQuality quality;
+            results.push_back(runBench(opt, "quality", "112x112", noSetup,
+                                       [&]() { gate.Check(face, quality); gate.CheckCrop(aligned, quality); }));
+        }
+        if (wanted("getFeature"))
+        {
+            Arcface arc(opt.model_folder);
+            if (opt.calibrate)
+                arc.CalibrateThreads();
+            results.push_back(runBench(opt, "getFeature", "112x112", noSetup,
+                                       [&]() { arc.getFeature(aligned); }));
+        }
+        if (wanted("getFeatures"))
+        {
+            Arcface arc(opt.model_folder);
+            if (opt.calibrate)
+                arc.CalibrateThreads();
+            ncnn::Mat faces = preprocessAll(img, crowd);
+            vector<vector<float> > features;
+            results.push_back(runBench(opt, "getFeatures", "16x112x112", noSetup,
+                                       [&]() { arc.getFeatures(faces, features); }));
+        }
+        FILE* int8_model = fopen((opt.model_folder + "/mobilefacenet-int8.bin").c_str(), "rb");
+        if (int8_model && wanted("getFeature-int8"))
+        {
+            Arcface arc(opt.model_folder, true);
+            results.push_back(runBench(opt, "getFeature-int8", "112x112", noSetup,
+                                       [&]() { arc.getFeature(aligned); }));
+        }
+        if (int8_model)
+            fclose(int8_model);
+    }
+
+    if (wanted("EmbeddingCache"))
+    {
+        // video of a camera panning back and forth over a frame of the
+        // bundled faces, a pixel per frame, 60 frames that loop. the faces of
+        // a frame are embedded straight through Arcface, then through an
+        // EmbeddingCache, whose counters are those of the timed frames
+        vector<string> paths;
+        for (int i = 0; i < BUNDLED_IMAGES; i++)
+            paths.push_back(opt.images + "/" + bundled_images[i]);
+        vector<FaceSource> sources = loadFaceSources(detector, paths);
+        if (sources.empty())
+            fprintf(stderr, "no faces in %s, skipping EmbeddingCache\n", opt.images.c_str());
+        else
+        {
+            const int frames = 60;
+            FrameSpec spec;
+            spec.width = img_w + frames / 2;
+            spec.height = img_h + frames / 4;
+            spec.faces = 4;
+            vector<FaceInfo> truth;
+            vector<unsigned char> scene = composeFrame(sources, spec, truth);
+            vector<ncnn::Mat> video(frames);
+            vector<vector<FaceInfo> > found(frames);
+            vector<unsigned char> pixels(img_w * img_h * 3);
+            for (int f = 0; f < frames; f++)
+            {
+                int pan = f < frames / 2 ? f : frames - f;
+                for (int y = 0; y < img_h; y++)
+                    memcpy(&pixels[y * img_w * 3], &scene[((y + pan / 2) * spec.width + pan) * 3], img_w * 3);
+                video[f] = ncnn::Mat::from_pixels(pixels.data(), ncnn::Mat::PIXEL_BGR, img_w, img_h);
+                detector.Detect(video[f], found[f]);
+            }
+
+            Arcface arc(opt.model_folder);
+            if (opt.calibrate)
+                arc.CalibrateThreads();
+            sprintf(shape, "%s/%df", img_shape.c_str(), (int)truth.size());
+            vector<float> feature;
+            int frame = 0;
+            results.push_back(runBench(opt, "EmbeddingCache-off", shape, noSetup, [&]() {
+                int f = frame++ % frames;
+                for (auto it = found[f].begin(); it != found[f].end(); it++)
+                    arc.getFeature(preprocess(video[f], *it), feature);
+            }));
+
+            EmbeddingCache cache;
+            frame = 0;
+            BenchResult result = runBench(opt, "EmbeddingCache", shape, noSetup, [&]() {
+                int f = frame++ % frames;
+                // the warmup frames start the tracks but are not counted
+                if (frame == opt.warmup + 1)
+                    cache.resetStats();
+                cache.NewFrame();
+                for (auto it = found[f].begin(); it != found[f].end(); it++)
+                    cache.getFeature(arc, video[f], *it, feature);
+            });
+            const CacheStats& stats = cache.stats();
+            result.counters.push_back(make_pair("hit_rate", stats.hitRate()));
+            result.counters.push_back(make_pair("hits", (double)stats.hits));
+            result.counters.push_back(make_pair("new_tracks", (double)stats.new_tracks));
+            result.counters.push_back(make_pair("changed", (double)stats.changed));
+            result.counters.push_back(make_pair("expired", (double)stats.expired));
+            results.push_back(result);
+        }
+    }
+
+    if (wanted("search"))
+    {
+        // Gallery::search over 20000 identities, alone and while another
+        // thread enrolls and compacts. searches never wait for the writer, so
+        // its p99 should stay close to the idle one
+        char dir[] = "/tmp/benchmark-gallery-XXXXXX";
+        if (!mkdtemp(dir))
+        {
+            fprintf(stderr, "cannot create a gallery directory, skipping search\n");
+        }
+        else
+        {
+            const int rows = 20000;
+            vector<vector<float> > features(4096);
+            for (auto f = features.begin(); f != features.end(); f++)
+                *f = synthFeature(128);
+            vector<float> query = synthFeature(128);
+            {
+                Gallery gallery(dir);
+                for (int i = 0; i < rows; i++)
+                    gallery.enroll("id" + to_string(i), features[i % features.size()], false);
+                gallery.compact();
+                sprintf(shape, "%d rows", rows);
+                results.push_back(runBench(opt, "search", shape, noSetup,
+                                           [&]() { gallery.search(query, 5); }));
+
+                atomic<bool> done(false);
+                int enrolled = 0, compactions = 0;
+                thread writer([&]() {
+                    while (!done)
+                    {
+                        gallery.enroll("new" + to_string(enrolled), features[enrolled % features.size()], false);
+                        if (++enrolled % 2000 == 0)
+                            compactions += gallery.compact();
+                    }
+                });
+                sprintf(shape, "%d rows+writer", rows);
+                BenchResult result = runBench(opt, "search", shape, noSetup,
+                                              [&]() { gallery.search(query, 5); });
+                done = true;
+                writer.join();
+                result.counters.push_back(make_pair("enrolled", (double)enrolled));
+                result.counters.push_back(make_pair("compactions", (double)compactions));
+                results.push_back(result);
+            }
+            removeDirectory(dir);
+        }
+    }
+
+    if (opt.json)
+        printJson(stdout, opt, results);
+    else
+        printTable(results);
+
+    return 0;
+}
@@ -0,0 +1,310 @@
+#include <cmath>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+#include <opencv2/opencv.hpp>
+#include "benchmark.h"
+#include "arcface.h"
+#include "graph.h"
+#include "int8.h"
+using namespace std;
+
+// Builds mobilefacenet-int8.param/bin next to the fp32 model. Activation scales
+// come from the inputs the convolutions see on a directory of aligned faces,
+// clipped at a percentile of their magnitude. The first convolution reads the
+// raw pixels and stays fp32 so the input transform can still be folded into it.
+// Depthwise weights get per channel int8 storage, the remaining fp32 weights
+// are written in the ncnn 8-bit table format.
+
+struct CalibOptions {
+    string model_folder = "../models";
+    string calib_dir;
+    string eval_dir;
+    float percentile = 99.99f;
+    int max_images = 500;
+    int max_pairs = 5000;
+};
+
+static const int bins = 2048;
+
+static vector<ncnn::Mat> loadFaces(const string& dir, int max_images)
+{
+    vector<cv::String> files;
+    cv::glob(dir, files, false);
+    sort(files.begin(), files.end());
+
+    vector<ncnn::Mat> faces;
+    for (auto it = files.begin(); it != files.end() && (int)faces.size() < max_images; it++)
+    {
+        cv::Mat img = cv::imread(*it);
+        if (img.empty())
+            continue;
+        ncnn::Mat in = ncnn::Mat::from_pixels(img.data, ncnn::Mat::PIXEL_BGR, img.cols, img.rows);
+        faces.push_back(bgr2rgb(resize(in, 112, 112)));
+    }
+    return faces;
+}
+
+// the quantization candidates and the blob each one reads
+static void findTargets(const ModelGraph& graph, vector<int>& targets)
+{
+    for (size_t i = 0; i < graph.layers.size(); i++)
+    {
+        const GraphLayer& layer = graph.layers[i];
+        if (layer.type != "Convolution")
+            continue;
+        // walk back over scalar arithmetic to see whether this reads the pixels
+        string blob = layer.bottoms[0];
+        bool first = false;
+        for (;;)
+        {
+            int producer = -1;
+            for (size_t j = 0; j < graph.layers.size() && producer < 0; j++)
+                if (find(graph.layers[j].tops.begin(), graph.layers[j].tops.end(), blob) != graph.layers[j].tops.end())
+                    producer = (int)j;
+            if (producer < 0 || graph.layers[producer].type == "Input")
+            {
+                first = true;
+                break;
+            }
+            const GraphLayer& op = graph.layers[producer];
+            if (op.type != "BinaryOp" || op.getInt(1, 0) != 1)
+                break;
+            blob = op.bottoms[0];
+        }
+        if (!first)
+            targets.push_back((int)i);
+    }
+}
+
+static void forEachActivation(ncnn::Net& net, const ModelGraph& graph, const vector<int>& targets,
+                              const vector<ncnn::Mat>& faces, const function<void(int, const ncnn::Mat&)>& fn)
+{
+    for (auto face = faces.begin(); face != faces.end(); face++)
+    {
+        ncnn::Extractor ex = net.create_extractor();
+        ex.set_light_mode(false);
+        ex.input("data", *face);
+        ncnn::Mat out;
+        ex.extract("fc1", out);
+        for (size_t t = 0; t < targets.size(); t++)
+        {
+            ncnn::Mat blob;
+            ex.extract(graph.layers[targets[t]].bottoms[0].c_str(), blob);
+            fn((int)t, blob);
+        }
+    }
+}
+
+static vector<float> calibrate(ncnn::Net& net, const ModelGraph& graph, const vector<int>& targets,
+                               const vector<ncnn::Mat>& faces, float percentile)
+{
+    vector<float> absmax(targets.size(), 0.f);
+    forEachActivation(net, graph, targets, faces, [&](int t, const ncnn::Mat& m) {
+        for (int q = 0; q < m.c; q++)
+        {
+            const float* ptr = m.channel(q);
+            for (int i = 0; i < m.w * m.h; i++)
+                absmax[t] = max(absmax[t], fabs(ptr[i]));
+        }
+    });
+
+    vector<vector<double> > hist(targets.size(), vector<double>(bins, 0.0));
+    forEachActivation(net, graph, targets, faces, [&](int t, const ncnn::Mat& m) {
+        if (absmax[t] == 0.f)
+            return;
+        for (int q = 0; q < m.c; q++)
+        {
+            const float* ptr = m.channel(q);
+            for (int i = 0; i < m.w * m.h; i++)
+                hist[t][min(bins - 1, (int)(fabs(ptr[i]) / absmax[t] * bins))] += 1.0;
+        }
+    });
+
+    vector<float> scales(targets.size());
+    for (size_t t = 0; t < targets.size(); t++)
+    {
+        double total = 0.0;
+        for (int b = 0; b < bins; b++)
+            total += hist[t][b];
+        double seen = 0.0;
+        int b = 0;
+        for (; b < bins - 1; b++)
+        {
+            seen += hist[t][b];
+            if (seen >= total * percentile / 100.0)
+                break;
+        }
+        float threshold = absmax[t] * (b + 1) / bins;
+        scales[t] = threshold > 0.f ? 127.f / threshold : 1.f;
+    }
+    return scales;
+}
+
+static vector<float> embed(ncnn::Net& net, const ncnn::Mat& face)
+{
+    ncnn::Extractor ex = net.create_extractor();
+    ex.set_light_mode(true);
+    ex.input("data", face);
+    ncnn::Mat out;
+    ex.extract("fc1", out);
+    vector<float> feature(out.w);
+    float sum = 0.f;
+    for (int i = 0; i < out.w; i++)
+        sum += out[i] * out[i];
+    sum = sqrt(sum);
+    for (int i = 0; i < out.w; i++)
+        feature[i] = out[i] / sum;
+    return feature;
+}
+
+static long fileSize(const string& path)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return -1;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static void report(ncnn::Net& fp32, ncnn::Net& int8, const vector<ncnn::Mat>& faces, int max_pairs)
+{
+    vector<vector<float> > f32, f8;
+    double t32 = 0.0, t8 = 0.0;
+    for (auto face = faces.begin(); face != faces.end(); face++)
+    {
+        double start = ncnn::get_current_time();
+        f32.push_back(embed(fp32, *face));
+        t32 += ncnn::get_current_time() - start;
+        start = ncnn::get_current_time();
+        f8.push_back(embed(int8, *face));
+        t8 += ncnn::get_current_time() - start;
+    }
+
+    double self_sum = 0.0, self_min = 1.0;
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        double sim = calcSimilar(f32[i], f8[i]);
+        self_sum += sim;
+        self_min = min(self_min, sim);
+    }
+
+    int pairs = 0;
+    double diff_sum = 0.0, diff_sq = 0.0, diff_max = 0.0;
+    for (size_t i = 0; i < faces.size() && pairs < max_pairs; i++)
+    {
+        for (size_t j = i + 1; j < faces.size() && pairs < max_pairs; j++)
+        {
+            double diff = fabs(calcSimilar(f32[i], f32[j]) - calcSimilar(f8[i], f8[j]));
+            diff_sum += diff;
+            diff_sq += diff * diff;
+            diff_max = max(diff_max, diff);
+            pairs++;
+        }
+    }
+
+    int n = (int)faces.size();
+    printf("faces                       %d\n", n);
+    printf("fp32 vs int8 embedding cos  mean %.5f  min %.5f\n", self_sum / n, self_min);
+    if (pairs > 0)
+        printf("pair similarity |diff|      mean %.5f  rms %.5f  max %.5f  (%d pairs)\n",
+               diff_sum / pairs, sqrt(diff_sq / pairs), diff_max, pairs);
+    printf("time per embedding          fp32 %.2f ms  int8 %.2f ms\n", t32 / n, t8 / n);
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s FACE_DIR [--models DIR] [--eval DIR] [--percentile P] [--max-images N] [--max-pairs N]\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+    CalibOptions opt;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--models" && i + 1 < argc)
+            opt.model_folder = argv[++i];
+        else if (arg == "--eval" && i + 1 < argc)
+            opt.eval_dir = argv[++i];
+        else if (arg == "--percentile" && i + 1 < argc)
+            opt.percentile = atof(argv[++i]);
+        else if (arg == "--max-images" && i + 1 < argc)
+            opt.max_images = atoi(argv[++i]);
+        else if (arg == "--max-pairs" && i + 1 < argc)
+            opt.max_pairs = atoi(argv[++i]);
+        else if (arg[0] != '-' && opt.calib_dir.empty())
+            opt.calib_dir = arg;
+        else
+        {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (opt.calib_dir.empty() || opt.percentile <= 0.f || opt.percentile > 100.f)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    if (opt.eval_dir.empty())
+        opt.eval_dir = opt.calib_dir;
+
+    string param_file = opt.model_folder + "/mobilefacenet.param";
+    string bin_file = opt.model_folder + "/mobilefacenet.bin";
+    string int8_param = opt.model_folder + "/mobilefacenet-int8.param";
+    string int8_bin = opt.model_folder + "/mobilefacenet-int8.bin";
+
+    // batchnorm goes first so the scales describe what the int8 layers will see
+    ModelGraph graph;
+    if (graph.load(param_file, bin_file) != 0)
+    {
+        fprintf(stderr, "failed to load %s\n", param_file.c_str());
+        return -1;
+    }
+    graph.foldBatchNorm();
+    ncnn::Net fp32;
+    if (graph.loadInto(fp32) != 0)
+        return -1;
+
+    vector<ncnn::Mat> faces = loadFaces(opt.calib_dir, opt.max_images);
+    if (faces.empty())
+    {
+        fprintf(stderr, "no images in %s\n", opt.calib_dir.c_str());
+        return -1;
+    }
+
+    vector<int> targets;
+    findTargets(graph, targets);
+    vector<float> scales = calibrate(fp32, graph, targets, faces, opt.percentile);
+
+    ModelGraph quantized = graph;
+    for (size_t t = 0; t < targets.size(); t++)
+        quantizeConvolution(quantized.layers[targets[t]], scales[t]);
+    int depthwise = 0;
+    for (auto it = quantized.layers.begin(); it != quantized.layers.end(); it++)
+        if (quantizeDepthWise(*it) == 0)
+            depthwise++;
+    if (quantized.save(int8_param, int8_bin, WEIGHT_TABLE) != 0)
+    {
+        fprintf(stderr, "failed to write %s\n", int8_param.c_str());
+        return -1;
+    }
+    printf("quantized %d convolutions and %d depthwise on %d faces, clipping at the %g percentile\n",
+           (int)targets.size(), depthwise, (int)faces.size(), opt.percentile);
+    printf("weights                     fp32 %ld bytes  int8 %ld bytes\n", fileSize(bin_file), fileSize(int8_bin));
+
+    // the report runs on the files as written
+    ncnn::Net int8;
+    registerInt8Layers(int8);
+    if (int8.load_param(int8_param.c_str()) != 0 || int8.load_model(int8_bin.c_str()) != 0)
+        return -1;
+
+    vector<ncnn::Mat> eval = opt.eval_dir == opt.calib_dir ? faces : loadFaces(opt.eval_dir, opt.max_images);
+    report(fp32, int8, eval, opt.max_pairs);
+    return 0;
+}
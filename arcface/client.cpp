@@ -0,0 +1,209 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unistd.h>
+#include "protocol.h"
+using namespace std;
+
+// Load test for the server: every connection sends its requests back to back
+// and the latencies of all of them are reported together.
+
+struct ClientOptions {
+    string address = "unix:/tmp/insightface.sock";
+    string image = "../image/gyy1.jpeg";
+    int connections = 4;
+    int requests = 50;
+    // faces per request when sending aligned crops instead of the image
+    int crops = 0;
+};
+
+struct ConnectionStats {
+    vector<double> latency;
+    vector<double> server;
+    vector<double> queue;
+    vector<int> batch;
+    int faces = 0;
+    int errors = 0;
+};
+
+static bool readFile(const string& path, vector<unsigned char>& data)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(data.data(), 1, size, fp) == (size_t)size;
+    fclose(fp);
+    return ok;
+}
+
+static double now()
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void run(const ClientOptions& opt, const vector<unsigned char>& request, ConnectionStats& stats)
+{
+    int fd = connectSocket(opt.address);
+    if (fd < 0)
+    {
+        stats.errors = opt.requests;
+        return;
+    }
+    vector<char> body;
+    for (int i = 0; i < opt.requests; i++)
+    {
+        double start = now();
+        ResponseHeader header;
+        if (!writeFull(fd, request.data(), request.size()) || !readFull(fd, &header, sizeof(header)) ||
+            header.magic != PROTOCOL_MAGIC)
+        {
+            stats.errors += opt.requests - i;
+            break;
+        }
+        body.resize(header.count * (sizeof(FaceRecord) + header.dim * sizeof(float)));
+        if (!readFull(fd, body.data(), body.size()))
+        {
+            stats.errors += opt.requests - i;
+            break;
+        }
+        if (header.status != STATUS_OK)
+        {
+            stats.errors++;
+            continue;
+        }
+        stats.latency.push_back(now() - start);
+        stats.server.push_back(header.total_us / 1000.0);
+        stats.queue.push_back(header.queue_us / 1000.0);
+        stats.batch.push_back(header.batch);
+        stats.faces += header.count;
+    }
+    close(fd);
+}
+
+static double percentile(const vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = (size_t)ceil(p / 100 * sorted.size());
+    return sorted[min(max(i, (size_t)1), sorted.size()) - 1];
+}
+
+static double mean(const vector<double>& v)
+{
+    double sum = 0;
+    for (auto it = v.begin(); it != v.end(); it++)
+        sum += *it;
+    return v.empty() ? 0 : sum / v.size();
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--connect unix:PATH|tcp:PORT] [--connections N] [--requests N] [--crops N] [image.jpg]\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+    ClientOptions opt;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--connect" && i + 1 < argc)
+            opt.address = argv[++i];
+        else if (arg == "--connections" && i + 1 < argc)
+            opt.connections = atoi(argv[++i]);
+        else if (arg == "--requests" && i + 1 < argc)
+            opt.requests = atoi(argv[++i]);
+        else if (arg == "--crops" && i + 1 < argc)
+            opt.crops = atoi(argv[++i]);
+        else if (arg[0] != '-')
+            opt.image = arg;
+        else
+        {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (opt.connections <= 0 || opt.requests <= 0 || opt.crops < 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    // one request, sent as is by every connection
+    vector<unsigned char> payload;
+    RequestHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTOCOL_MAGIC;
+    if (opt.crops > 0)
+    {
+        header.type = REQUEST_CROPS;
+        header.width = header.height = 112;
+        header.count = opt.crops;
+        payload.resize(opt.crops * 112 * 112 * 3);
+        for (size_t i = 0; i < payload.size(); i++)
+            payload[i] = (unsigned char)(i * 7 + i / 336);
+    }
+    else
+    {
+        header.type = REQUEST_JPEG;
+        if (!readFile(opt.image, payload))
+        {
+            fprintf(stderr, "failed to read %s\n", opt.image.c_str());
+            return -1;
+        }
+    }
+    header.size = payload.size();
+    vector<unsigned char> request(sizeof(header) + payload.size());
+    memcpy(request.data(), &header, sizeof(header));
+    memcpy(request.data() + sizeof(header), payload.data(), payload.size());
+
+    vector<ConnectionStats> stats(opt.connections);
+    vector<thread> threads;
+    double start = now();
+    for (int i = 0; i < opt.connections; i++)
+        threads.push_back(thread(run, cref(opt), cref(request), ref(stats[i])));
+    for (auto it = threads.begin(); it != threads.end(); it++)
+        it->join();
+    double elapsed = (now() - start) / 1000;
+
+    ConnectionStats all;
+    for (auto it = stats.begin(); it != stats.end(); it++)
+    {
+        all.latency.insert(all.latency.end(), it->latency.begin(), it->latency.end());
+        all.server.insert(all.server.end(), it->server.begin(), it->server.end());
+        all.queue.insert(all.queue.end(), it->queue.begin(), it->queue.end());
+        all.batch.insert(all.batch.end(), it->batch.begin(), it->batch.end());
+        all.faces += it->faces;
+        all.errors += it->errors;
+    }
+    sort(all.latency.begin(), all.latency.end());
+    double batch = 0;
+    int batched = 0;
+    for (auto it = all.batch.begin(); it != all.batch.end(); it++)
+        if (*it > 0)
+        {
+            batch += *it;
+            batched++;
+        }
+
+    int done = (int)all.latency.size();
+    printf("%d requests, %d errors, %d faces in %.2f s: %.1f requests/s, %.1f faces/s\n",
+           done, all.errors, all.faces, elapsed, done / elapsed, all.faces / elapsed);
+    printf("latency ms: mean %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+           mean(all.latency), percentile(all.latency, 50), percentile(all.latency, 90),
+           percentile(all.latency, 99), percentile(all.latency, 100));
+    printf("server ms: mean %.2f, of which batch wait %.2f; mean batch %.1f faces\n",
+           mean(all.server), mean(all.queue), batched ? batch / batched : 0);
+    return all.errors ? 1 : 0;
+}
@@ -0,0 +1,203 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "benchmark.h"
+#include "arcface.h"
+#include "mtcnn.h"
+#include "jpegimage.h"
+#include "clustering.h"
+using namespace std;
+
+// Groups the faces of a photo collection. Features come from the JPEG files
+// of a directory, each face detected, aligned and embedded, or from a raw
+// file of float32 rows as written by --save. The file is memory mapped, so
+// collections larger than memory are read a block at a time. Prints one
+// "name<TAB>cluster" line per face, clusters numbered from 0.
+
+struct ClusterOptions {
+    string images;
+    string features;
+    string save;
+    string model_folder = "../models";
+    int dim = 128;
+    int k = 10;
+    float threshold = 0.5f;
+    bool whispers = false;
+    int block = 512;
+};
+
+static bool isJpeg(const string& name)
+{
+    size_t dot = name.rfind('.');
+    if (dot == string::npos)
+        return false;
+    string ext = name.substr(dot + 1);
+    for (auto it = ext.begin(); it != ext.end(); it++)
+        *it = tolower(*it);
+    return ext == "jpg" || ext == "jpeg";
+}
+
+// one row per face of every JPEG in dir, named file#index
+static void embedImages(const ClusterOptions& opt, vector<float>& features, vector<string>& names)
+{
+    vector<string> files;
+    DIR* d = opendir(opt.images.c_str());
+    if (d)
+    {
+        while (dirent* entry = readdir(d))
+            if (isJpeg(entry->d_name))
+                files.push_back(entry->d_name);
+        closedir(d);
+    }
+    sort(files.begin(), files.end());
+
+    MtcnnDetector detector(opt.model_folder);
+    Arcface arc(opt.model_folder);
+    arc.CalibrateThreads();
+    JpegImage jpeg;
+    vector<FaceInfo> faces;
+    vector<vector<float> > embedded;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!jpeg.open(opt.images + "/" + files[i]))
+        {
+            fprintf(stderr, "skipping %s\n", files[i].c_str());
+            continue;
+        }
+        ncnn::Mat crops = detectAligned(detector, jpeg, faces);
+        if (crops.empty())
+            continue;
+        arc.getFeatures(crops, embedded);
+        for (size_t f = 0; f < embedded.size(); f++)
+        {
+            features.insert(features.end(), embedded[f].begin(), embedded[f].end());
+            names.push_back(files[i] + "#" + to_string(f));
+        }
+    }
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s (--images DIR [--save FILE] | --features FILE [--dim N]) [--models DIR]\n"
+            "       [--k N] [--threshold T] [--whispers] [--block N]\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+    ClusterOptions opt;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--images" && i + 1 < argc)
+            opt.images = argv[++i];
+        else if (arg == "--features" && i + 1 < argc)
+            opt.features = argv[++i];
+        else if (arg == "--save" && i + 1 < argc)
+            opt.save = argv[++i];
+        else if (arg == "--models" && i + 1 < argc)
+            opt.model_folder = argv[++i];
+        else if (arg == "--dim" && i + 1 < argc)
+            opt.dim = atoi(argv[++i]);
+        else if (arg == "--k" && i + 1 < argc)
+            opt.k = atoi(argv[++i]);
+        else if (arg == "--threshold" && i + 1 < argc)
+            opt.threshold = atof(argv[++i]);
+        else if (arg == "--whispers")
+            opt.whispers = true;
+        else if (arg == "--block" && i + 1 < argc)
+            opt.block = atoi(argv[++i]);
+        else
+        {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (opt.images.empty() == opt.features.empty() || opt.dim <= 0 || opt.k <= 0 || opt.block <= 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    vector<float> embedded;
+    vector<string> names;
+    const float* features = 0;
+    long n = 0;
+    void* mapped = MAP_FAILED;
+    size_t mapped_size = 0;
+    double start = ncnn::get_current_time();
+    if (!opt.images.empty())
+    {
+        embedImages(opt, embedded, names);
+        features = embedded.data();
+        n = names.size();
+        fprintf(stderr, "%ld faces embedded in %.1f s\n", n, (ncnn::get_current_time() - start) / 1000);
+        if (!opt.save.empty())
+        {
+            FILE* fp = fopen(opt.save.c_str(), "wb");
+            if (!fp || fwrite(features, sizeof(float) * opt.dim, n, fp) != (size_t)n)
+                fprintf(stderr, "failed to write %s\n", opt.save.c_str());
+            if (fp)
+                fclose(fp);
+        }
+    }
+    else
+    {
+        int fd = open(opt.features.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || st.st_size % (sizeof(float) * opt.dim) != 0)
+        {
+            fprintf(stderr, "%s is not a file of %d float rows\n", opt.features.c_str(), opt.dim);
+            return -1;
+        }
+        mapped_size = st.st_size;
+        n = mapped_size / (sizeof(float) * opt.dim);
+        if (mapped_size > 0)
+        {
+            mapped = mmap(0, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapped == MAP_FAILED)
+            {
+                fprintf(stderr, "cannot map %s\n", opt.features.c_str());
+                return -1;
+            }
+            features = (const float*)mapped;
+        }
+        close(fd);
+        for (long i = 0; i < n; i++)
+            names.push_back(to_string(i));
+    }
+
+    start = ncnn::get_current_time();
+    // edges below the clustering threshold are never used, so they are not kept
+    KnnGraph graph = buildKnn(features, n, opt.dim, opt.k, opt.threshold, opt.block);
+    double knn_ms = ncnn::get_current_time() - start;
+    start = ncnn::get_current_time();
+    vector<int> labels = opt.whispers ? chineseWhispers(graph, opt.threshold)
+                                      : connectedComponents(graph, opt.threshold);
+    double cluster_ms = ncnn::get_current_time() - start;
+
+    vector<int> sizes;
+    for (long i = 0; i < n; i++)
+    {
+        if (labels[i] >= (int)sizes.size())
+            sizes.resize(labels[i] + 1, 0);
+        sizes[labels[i]]++;
+        printf("%s\t%d\n", names[i].c_str(), labels[i]);
+    }
+    int singletons = count(sizes.begin(), sizes.end(), 1);
+    int largest = sizes.empty() ? 0 : *max_element(sizes.begin(), sizes.end());
+    fprintf(stderr, "%ld faces, %d clusters, %d singletons, largest %d; knn %.1f ms, %s %.1f ms\n",
+            n, (int)sizes.size(), singletons, largest, knn_ms,
+            opt.whispers ? "chinese whispers" : "components", cluster_ms);
+
+    if (mapped != MAP_FAILED)
+        munmap(mapped, mapped_size);
+    return 0;
+}
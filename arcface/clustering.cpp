@@ -0,0 +1,305 @@
+#include <atomic>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include "clustering.h"
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
+// out[i * nd + j] = dot(q row i, d row j). each query row is loaded once for
+// four data rows
+static void tileSimilarity(const float* q, int nq, const float* d, int nd, int dim, float* out)
+{
+    for (int i = 0; i < nq; i++)
+    {
+        const float* a = q + (size_t)i * dim;
+        float* row = out + (size_t)i * nd;
+        int j = 0;
+#if __SSE2__
+        for (; j + 4 <= nd; j += 4)
+        {
+            const float* b0 = d + (size_t)j * dim;
+            const float* b1 = b0 + dim;
+            const float* b2 = b1 + dim;
+            const float* b3 = b2 + dim;
+            __m128 s0 = _mm_setzero_ps();
+            __m128 s1 = _mm_setzero_ps();
+            __m128 s2 = _mm_setzero_ps();
+            __m128 s3 = _mm_setzero_ps();
+            int x = 0;
+            for (; x + 4 <= dim; x += 4)
+            {
+                __m128 va = _mm_loadu_ps(a + x);
+                s0 = _mm_add_ps(s0, _mm_mul_ps(va, _mm_loadu_ps(b0 + x)));
+                s1 = _mm_add_ps(s1, _mm_mul_ps(va, _mm_loadu_ps(b1 + x)));
+                s2 = _mm_add_ps(s2, _mm_mul_ps(va, _mm_loadu_ps(b2 + x)));
+                s3 = _mm_add_ps(s3, _mm_mul_ps(va, _mm_loadu_ps(b3 + x)));
+            }
+            // transpose so that lane k holds the sum of data row j + k
+            _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+            __m128 sum = _mm_add_ps(_mm_add_ps(s0, s1), _mm_add_ps(s2, s3));
+            float tail[4] = {0, 0, 0, 0};
+            for (; x < dim; x++)
+            {
+                tail[0] += a[x] * b0[x];
+                tail[1] += a[x] * b1[x];
+                tail[2] += a[x] * b2[x];
+                tail[3] += a[x] * b3[x];
+            }
+            _mm_storeu_ps(row + j, _mm_add_ps(sum, _mm_loadu_ps(tail)));
+        }
+#endif
+        for (; j < nd; j++)
+        {
+            const float* b = d + (size_t)j * dim;
+            float sum = 0;
+            for (int x = 0; x < dim; x++)
+                sum += a[x] * b[x];
+            row[j] = sum;
+        }
+    }
+}
+
+KnnGraph buildKnn(const float* features, int n, int dim, int k, float min_similarity, int block)
+{
+    KnnGraph graph;
+    graph.n = n;
+    graph.k = k;
+    if (n <= 0 || k <= 0)
+        return graph;
+    graph.neighbors.assign((size_t)n * k, -1);
+    // below any similarity, so the first neighbour always goes in
+    graph.similarity.assign((size_t)n * k, -2.f);
+    block = max(block, 4);
+    int blocks = (n + block - 1) / block;
+
+    #pragma omp parallel
+    {
+        vector<float> tile((size_t)block * block);
+        // query blocks differ in cost only at the end, dynamic keeps the
+        // threads busy to the last one
+        #pragma omp for schedule(dynamic)
+        for (int qb = 0; qb < blocks; qb++)
+        {
+            int q0 = qb * block;
+            int nq = min(block, n - q0);
+            for (int db = 0; db < blocks; db++)
+            {
+                int d0 = db * block;
+                int nd = min(block, n - d0);
+                tileSimilarity(features + (size_t)q0 * dim, nq, features + (size_t)d0 * dim, nd, dim, tile.data());
+                for (int i = 0; i < nq; i++)
+                {
+                    int q = q0 + i;
+                    int* ids = &graph.neighbors[(size_t)q * k];
+                    float* sims = &graph.similarity[(size_t)q * k];
+                    const float* row = &tile[(size_t)i * nd];
+                    for (int j = 0; j < nd; j++)
+                    {
+                        float s = row[j];
+                        if (s <= sims[k - 1] || s < min_similarity || d0 + j == q)
+                            continue;
+                        int at = k - 1;
+                        while (at > 0 && sims[at - 1] < s)
+                        {
+                            sims[at] = sims[at - 1];
+                            ids[at] = ids[at - 1];
+                            at--;
+                        }
+                        sims[at] = s;
+                        ids[at] = d0 + j;
+                    }
+                }
+            }
+        }
+    }
+    return graph;
+}
+
+// union-find with path halving. roots only ever get linked to smaller
+// roots, so concurrent unions cannot form a cycle
+static int findRoot(atomic<int>* parent, int x)
+{
+    while (true)
+    {
+        int p = parent[x].load(memory_order_relaxed);
+        if (p == x)
+            return x;
+        int gp = parent[p].load(memory_order_relaxed);
+        if (gp != p)
+            parent[x].compare_exchange_weak(p, gp, memory_order_relaxed);
+        x = gp;
+    }
+}
+
+static void unite(atomic<int>* parent, int a, int b)
+{
+    while (true)
+    {
+        a = findRoot(parent, a);
+        b = findRoot(parent, b);
+        if (a == b)
+            return;
+        if (a < b)
+            swap(a, b);
+        int expected = a;
+        if (parent[a].compare_exchange_strong(expected, b))
+            return;
+    }
+}
+
+// labels renumbered 0, 1 ... in the order of their first row
+static vector<int> renumber(const vector<int>& labels)
+{
+    int n = (int)labels.size();
+    vector<int> map(n, -1);
+    vector<int> out(n);
+    int next = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int& label = map[labels[i]];
+        if (label < 0)
+            label = next++;
+        out[i] = label;
+    }
+    return out;
+}
+
+vector<int> connectedComponents(const KnnGraph& graph, float threshold)
+{
+    int n = graph.n;
+    int k = graph.k;
+    unique_ptr<atomic<int>[]> parent(new atomic<int>[n]);
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++)
+        parent[i].store(i, memory_order_relaxed);
+
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < k; j++)
+        {
+            size_t e = (size_t)i * k + j;
+            // the lists are sorted, the rest is below the threshold too
+            if (graph.neighbors[e] < 0 || graph.similarity[e] < threshold)
+                break;
+            unite(parent.get(), i, graph.neighbors[e]);
+        }
+    }
+
+    vector<int> labels(n);
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++)
+        labels[i] = findRoot(parent.get(), i);
+    return renumber(labels);
+}
+
+vector<int> chineseWhispers(const KnnGraph& graph, float threshold, int iterations)
+{
+    int n = graph.n;
+    int k = graph.k;
+
+    // undirected edges above the threshold, as adjacency lists. a pair that
+    // lists each other is kept once per direction
+    auto listed = [&](int from, int to) {
+        for (int j = 0; j < k; j++)
+        {
+            size_t e = (size_t)from * k + j;
+            if (graph.neighbors[e] < 0 || graph.similarity[e] < threshold)
+                return false;
+            if (graph.neighbors[e] == to)
+                return true;
+        }
+        return false;
+    };
+    vector<int> degree(n + 1, 0);
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < k; j++)
+        {
+            size_t e = (size_t)i * k + j;
+            int nb = graph.neighbors[e];
+            if (nb < 0 || graph.similarity[e] < threshold)
+                break;
+            degree[i + 1]++;
+            if (!listed(nb, i))
+                degree[nb + 1]++;
+        }
+    for (int i = 0; i < n; i++)
+        degree[i + 1] += degree[i];
+    vector<int> adjacent(degree[n]);
+    vector<float> weight(degree[n]);
+    vector<int> filled(degree.begin(), degree.end() - 1);
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < k; j++)
+        {
+            size_t e = (size_t)i * k + j;
+            int nb = graph.neighbors[e];
+            if (nb < 0 || graph.similarity[e] < threshold)
+                break;
+            adjacent[filled[i]] = nb;
+            weight[filled[i]++] = graph.similarity[e];
+            if (!listed(nb, i))
+            {
+                adjacent[filled[nb]] = i;
+                weight[filled[nb]++] = graph.similarity[e];
+            }
+        }
+
+    unique_ptr<atomic<int>[]> label(new atomic<int>[n]);
+    for (int i = 0; i < n; i++)
+        label[i].store(i, memory_order_relaxed);
+    vector<int> order(n);
+    for (int i = 0; i < n; i++)
+        order[i] = i;
+    mt19937 rng(12345);
+
+    for (int it = 0; it < iterations; it++)
+    {
+        shuffle(order.begin(), order.end(), rng);
+        int changed = 0;
+        // rows are updated in place, as in the sequential algorithm; a
+        // neighbour's label may be read before or after its own update
+        #pragma omp parallel reduction(+:changed)
+        {
+            vector<pair<int, float> > votes;
+            #pragma omp for schedule(dynamic, 1024)
+            for (int o = 0; o < n; o++)
+            {
+                int v = order[o];
+                if (degree[v] == degree[v + 1])
+                    continue;
+                votes.clear();
+                for (int e = degree[v]; e < degree[v + 1]; e++)
+                {
+                    int l = label[adjacent[e]].load(memory_order_relaxed);
+                    auto vote = votes.begin();
+                    while (vote != votes.end() && vote->first != l)
+                        vote++;
+                    if (vote == votes.end())
+                        votes.push_back(make_pair(l, weight[e]));
+                    else
+                        vote->second += weight[e];
+                }
+                // ties go to the smaller label, so the result does not depend on the edge order
+                pair<int, float> best = votes[0];
+                for (auto vote = votes.begin() + 1; vote != votes.end(); vote++)
+                    if (vote->second > best.second || (vote->second == best.second && vote->first < best.first))
+                        best = *vote;
+                if (best.first != label[v].load(memory_order_relaxed))
+                {
+                    label[v].store(best.first, memory_order_relaxed);
+                    changed++;
+                }
+            }
+        }
+        if (changed == 0)
+            break;
+    }
+
+    vector<int> labels(n);
+    for (int i = 0; i < n; i++)
+        labels[i] = label[i].load(memory_order_relaxed);
+    return renumber(labels);
+}
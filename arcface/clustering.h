@@ -0,0 +1,36 @@
+#ifndef CLUSTERING_H
+#define CLUSTERING_H
+
+#include <vector>
+
+using namespace std;
+
+// The k most similar other rows of every row of a feature matrix, best first.
+// Rows with fewer than k neighbours above the threshold of buildKnn have the
+// rest of their list set to -1.
+struct KnnGraph {
+    int n = 0;
+    int k = 0;
+    // n * k
+    vector<int> neighbors;
+    vector<float> similarity;
+};
+
+// n rows of dim normalized floats, row-major, compared as by calcSimilar.
+// The matrix is compared against itself one pair of blocks of block rows at a
+// time, in parallel over the query blocks, so besides the graph only one
+// block x block tile of similarities per thread is held. features may be a
+// memory mapped file larger than memory; it is read block by block.
+KnnGraph buildKnn(const float* features, int n, int dim, int k, float min_similarity = 0, int block = 512);
+
+// label of every row, 0 up to the number of clusters, numbered in the order
+// of their first row. rows are joined when either lists the other with at
+// least threshold similarity. a parallel union-find over the edges
+vector<int> connectedComponents(const KnnGraph& graph, float threshold);
+
+// Chinese whispers on the same edges weighted by similarity: every row takes
+// the label with the largest weight among its neighbours, repeatedly. unlike
+// connected components a weak chain of edges does not merge two clusters
+vector<int> chineseWhispers(const KnnGraph& graph, float threshold, int iterations = 20);
+
+#endif
@@ -0,0 +1,125 @@
+#include <cmath>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include "benchmark.h"
+#include "graph.h"
+#include "int8.h"
+using namespace std;
+
+// Rewrites the models of one folder into another with the typed weight blobs
+// stored as fp16 (or as 8-bit tables). Layer structure and blob names are
+// untouched, so MtcnnDetector and Arcface load the output folder as is.
+
+static long fileSize(const string& path)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return -1;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static double loadTime(const string& param_file, const string& bin_file)
+{
+    ncnn::Net net;
+    registerInt8Layers(net);
+    double start = ncnn::get_current_time();
+    net.load_param(param_file.c_str());
+    net.load_model(bin_file.c_str());
+    return ncnn::get_current_time() - start;
+}
+
+// largest difference between the weights as written and the originals
+static float maxError(const ModelGraph& a, const ModelGraph& b)
+{
+    float error = 0.f;
+    for (size_t i = 0; i < a.layers.size(); i++)
+    {
+        for (size_t j = 0; j < a.layers[i].weights.size(); j++)
+        {
+            const ncnn::Mat& x = a.layers[i].weights[j];
+            const ncnn::Mat& y = b.layers[i].weights[j];
+            for (int k = 0; k < x.w; k++)
+                error = fmax(error, fabs(x[k] - y[k]));
+        }
+    }
+    return error;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s IN_DIR OUT_DIR [--format fp16|table|fp32] [MODEL...]\n"
+            "       models default to det1 det2 det3 det4 mobilefacenet\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+    vector<string> dirs;
+    vector<string> models;
+    WeightFormat format = WEIGHT_FP16;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--format" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            if (name == "fp16")
+                format = WEIGHT_FP16;
+            else if (name == "table")
+                format = WEIGHT_TABLE;
+            else if (name == "fp32")
+                format = WEIGHT_FP32;
+            else
+            {
+                usage(argv[0]);
+                return -1;
+            }
+        }
+        else if (arg[0] == '-')
+        {
+            usage(argv[0]);
+            return -1;
+        }
+        else if (dirs.size() < 2)
+            dirs.push_back(arg);
+        else
+            models.push_back(arg);
+    }
+    if (dirs.size() != 2 || dirs[0] == dirs[1])
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    if (models.empty())
+    {
+        const char* names[] = {"det1", "det2", "det3", "det4", "mobilefacenet"};
+        models.assign(names, names + 5);
+    }
+
+    int failed = 0;
+    printf("%-16s %12s %12s %10s %10s %12s\n", "model", "in bytes", "out bytes", "in load", "out load", "max error");
+    for (auto it = models.begin(); it != models.end(); it++)
+    {
+        string in_param = dirs[0] + "/" + *it + ".param";
+        string in_bin = dirs[0] + "/" + *it + ".bin";
+        string out_param = dirs[1] + "/" + *it + ".param";
+        string out_bin = dirs[1] + "/" + *it + ".bin";
+
+        ModelGraph graph, written;
+        if (graph.load(in_param, in_bin) != 0 || graph.save(out_param, out_bin, format) != 0
+            || written.load(out_param, out_bin) != 0)
+        {
+            fprintf(stderr, "failed to convert %s\n", it->c_str());
+            failed++;
+            continue;
+        }
+
+        printf("%-16s %12ld %12ld %8.2fms %8.2fms %12.3e\n", it->c_str(), fileSize(in_bin), fileSize(out_bin),
+               loadTime(in_param, in_bin), loadTime(out_param, out_bin), maxError(graph, written));
+    }
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,98 @@
+#ifndef CVINTEROP_H
+#define CVINTEROP_H
+
+// Conversions between cv::Mat and the types of this library. Header only, so
+// that the library itself does not depend on OpenCV.
+
+#include <cmath>
+#include <cstring>
+#include <opencv2/opencv.hpp>
+#include "net.h"
+#include "base.h"
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
+// the pixels of a CV_8UC3 BGR image, used in place. valid while img is
+inline ImageView cv2view(const cv::Mat& img)
+{
+    CV_Assert(img.type() == CV_8UC3);
+    return ImageView(img.data, img.cols, img.rows, (int)img.step, ncnn::Mat::PIXEL_BGR);
+}
+
+#if __SSE2__
+// 16 floats rounded and saturated to bytes
+static inline __m128i packBytes(const float* p)
+{
+    __m128i a = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(p)), _mm_cvtps_epi32(_mm_loadu_ps(p + 4)));
+    __m128i b = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(p + 8)), _mm_cvtps_epi32(_mm_loadu_ps(p + 12)));
+    return _mm_packus_epi16(a, b);
+}
+
+// four BGRX pixels written as 12 bytes; each store also writes the byte after
+// its pixel, which the next pixel overwrites
+static inline void storePixels(unsigned char* out, __m128i pixels)
+{
+    for (int k = 0; k < 4; k++)
+    {
+        int v = _mm_cvtsi128_si32(pixels);
+        memcpy(out + 3 * k, &v, 4);
+        pixels = _mm_srli_si128(pixels, 4);
+    }
+}
+#endif
+
+// Writes the BGR planes of a float Mat, as made by from_pixels(PIXEL_BGR) or
+// preprocess(), into dst as CV_8UC3. dst is reallocated only if its size or
+// type differ, so a preallocated Mat or ROI is written in place.
+inline void ncnn2cv(const ncnn::Mat& src, cv::Mat& dst)
+{
+    dst.create(src.h, src.w, CV_8UC3);
+    int w = src.w;
+    for (int y = 0; y < src.h; y++)
+    {
+        const float* b = (const float*)src.channel(0) + y * w;
+        const float* g = (const float*)src.channel(1) + y * w;
+        const float* r = (const float*)src.channel(2) + y * w;
+        unsigned char* out = dst.data + y * dst.step;
+        int x = 0;
+#if __SSE2__
+        // the last pixel of a row goes through the scalar loop, so the
+        // overlapping stores never write past the row
+        __m128i zero = _mm_setzero_si128();
+        for (; x + 16 < w; x += 16)
+        {
+            __m128i vb = packBytes(b + x);
+            __m128i vg = packBytes(g + x);
+            __m128i vr = packBytes(r + x);
+            __m128i bg_lo = _mm_unpacklo_epi8(vb, vg);
+            __m128i bg_hi = _mm_unpackhi_epi8(vb, vg);
+            __m128i r_lo = _mm_unpacklo_epi8(vr, zero);
+            __m128i r_hi = _mm_unpackhi_epi8(vr, zero);
+            storePixels(out + 3 * x, _mm_unpacklo_epi16(bg_lo, r_lo));
+            storePixels(out + 3 * x + 12, _mm_unpackhi_epi16(bg_lo, r_lo));
+            storePixels(out + 3 * x + 24, _mm_unpacklo_epi16(bg_hi, r_hi));
+            storePixels(out + 3 * x + 36, _mm_unpackhi_epi16(bg_hi, r_hi));
+        }
+#endif
+        for (; x < w; x++)
+        {
+            const float v[3] = {b[x], g[x], r[x]};
+            for (int c = 0; c < 3; c++)
+            {
+                long q = lrintf(v[c]);
+                out[3 * x + c] = (unsigned char)(q < 0 ? 0 : q > 255 ? 255 : q);
+            }
+        }
+    }
+}
+
+inline cv::Mat ncnn2cv(const ncnn::Mat& src)
+{
+    cv::Mat dst;
+    ncnn2cv(src, dst);
+    return dst;
+}
+
+#endif
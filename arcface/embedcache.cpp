@@ -0,0 +1,117 @@
+#include <algorithm>
+#include "embedcache.h"
+
+static float iou(const int* a, const FaceInfo& b)
+{
+    int w = min(a[2], b.x[1]) - max(a[0], b.x[0]) + 1;
+    int h = min(a[3], b.y[1]) - max(a[1], b.y[0]) + 1;
+    if (w <= 0 || h <= 0)
+        return 0.f;
+    float inter = (float)w * h;
+    float area_a = (float)(a[2] - a[0] + 1) * (a[3] - a[1] + 1);
+    float area_b = (float)(b.x[1] - b.x[0] + 1) * (b.y[1] - b.y[0] + 1);
+    return inter / (area_a + area_b - inter);
+}
+
+// landmarks around their centroid in units of the box side, so a face that
+// only moves keeps them and the jitter of the box regression does not count
+static void relativeLandmarks(const FaceInfo& info, float* out)
+{
+    float side = (float)max(1, max(info.x[1] - info.x[0], info.y[1] - info.y[0]));
+    float cx = 0.f, cy = 0.f;
+    for (int i = 0; i < 5; i++)
+    {
+        cx += info.landmark[2 * i] * 0.2f;
+        cy += info.landmark[2 * i + 1] * 0.2f;
+    }
+    for (int i = 0; i < 5; i++)
+    {
+        out[2 * i] = (info.landmark[2 * i] - cx) / side;
+        out[2 * i + 1] = (info.landmark[2 * i + 1] - cy) / side;
+    }
+}
+
+void EmbeddingCache::NewFrame()
+{
+    // tracks missing from the frame that just ended are gone
+    for (size_t i = 0; i < tracks.size(); )
+    {
+        if (tracks[i].seen < frame)
+        {
+            tracks[i] = tracks.back();
+            tracks.pop_back();
+        }
+        else
+            i++;
+    }
+    frame++;
+}
+
+void EmbeddingCache::clear()
+{
+    tracks.clear();
+}
+
+bool EmbeddingCache::getFeature(Arcface& arc, ncnn::Mat img, const FaceInfo& info, vector<float>& feature)
+{
+    Track* track = 0;
+    float best = min_iou;
+    for (auto it = tracks.begin(); it != tracks.end(); it++)
+    {
+        // one face per track and frame
+        if (it->seen == frame)
+            continue;
+        float overlap = iou(it->box, info);
+        if (overlap >= best)
+        {
+            best = overlap;
+            track = &*it;
+        }
+    }
+
+    float landmarks[10];
+    relativeLandmarks(info, landmarks);
+    bool hit = false;
+    if (!track)
+    {
+        tracks.push_back(Track());
+        track = &tracks.back();
+        counters.new_tracks++;
+    }
+    else if (refresh_interval > 0 && frame - track->embedded >= refresh_interval)
+    {
+        counters.expired++;
+    }
+    else
+    {
+        float shift = 0.f;
+        for (int i = 0; i < 5; i++)
+        {
+            float dx = landmarks[2 * i] - track->landmarks[2 * i];
+            float dy = landmarks[2 * i + 1] - track->landmarks[2 * i + 1];
+            shift = max(shift, dx * dx + dy * dy);
+        }
+        hit = shift <= max_shift * max_shift;
+        if (hit)
+            counters.hits++;
+        else
+            counters.changed++;
+    }
+
+    track->box[0] = info.x[0];
+    track->box[1] = info.y[0];
+    track->box[2] = info.x[1];
+    track->box[3] = info.y[1];
+    track->seen = frame;
+    if (hit)
+    {
+        feature = track->feature;
+        return true;
+    }
+
+    arc.getFeature(preprocess(img, info), track->feature);
+    memcpy(track->landmarks, landmarks, sizeof(landmarks));
+    track->embedded = frame;
+    feature = track->feature;
+    return false;
+}
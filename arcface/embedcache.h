@@ -0,0 +1,61 @@
+#ifndef EMBEDCACHE_H
+#define EMBEDCACHE_H
+
+#include <vector>
+#include "net.h"
+#include "base.h"
+#include "arcface.h"
+
+using namespace std;
+
+struct CacheStats {
+    long hits = 0;
+    // misses, by cause
+    long new_tracks = 0;
+    long changed = 0;
+    long expired = 0;
+
+    long lookups() const { return hits + new_tracks + changed + expired; }
+    double hitRate() const { return lookups() ? (double)hits / lookups() : 0.0; }
+};
+
+// Embeddings of the faces of the previous frame, for video where the same
+// person is visible on many consecutive frames. A face continues a track when
+// its box overlaps the track's box of the previous frame; the cached embedding
+// is returned as long as the landmark layout (scaled by the box, wherever the
+// face is) stays close to the one it was computed from and the refresh
+// interval has not run out. Tracks not seen on a frame are dropped. One cache
+// per video stream.
+class EmbeddingCache {
+public:
+    // box IoU against the previous frame to continue a track
+    float min_iou = 0.5f;
+    // largest landmark displacement, as a fraction of the box side
+    float max_shift = 0.04f;
+    // frames after which a track is embedded again, 0 = never
+    int refresh_interval = 30;
+
+    // call once per frame before the lookups of its faces
+    void NewFrame();
+    // fills feature from the cache or from arc. returns true on a cache hit
+    bool getFeature(Arcface& arc, ncnn::Mat img, const FaceInfo& info, vector<float>& feature);
+    void clear();
+
+    const CacheStats& stats() const { return counters; }
+    void resetStats() { counters = CacheStats(); }
+
+private:
+    struct Track {
+        int box[4];
+        // landmarks relative to the box when the embedding was computed
+        float landmarks[10];
+        vector<float> feature;
+        long embedded;
+        long seen;
+    };
+    vector<Track> tracks;
+    long frame = 0;
+    CacheStats counters;
+};
+
+#endif
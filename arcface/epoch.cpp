@@ -0,0 +1,120 @@
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include "epoch.h"
+
+using namespace std;
+
+// a reader's slot holds the global epoch it entered at, 0 while outside.
+// padded to a cache line so readers do not share lines
+struct EpochSlot {
+    atomic<unsigned long long> epoch;
+    atomic<bool> taken;
+    char pad[64 - sizeof(atomic<unsigned long long>) - sizeof(atomic<bool>)];
+};
+
+static const int max_slots = 256;
+static EpochSlot slots[max_slots];
+static atomic<unsigned long long> global_epoch(1);
+
+struct Retired {
+    unsigned long long epoch;
+    void* obj;
+    void (*destroy)(void*);
+};
+
+static mutex retired_lock;
+static vector<Retired> retired;
+
+// the slot of the calling thread, claimed on first use and released when the
+// thread exits
+struct ThreadSlot {
+    int index = -1;
+    int depth = 0;
+
+    ~ThreadSlot()
+    {
+        if (index >= 0)
+            slots[index].taken.store(false, memory_order_release);
+    }
+
+    int get()
+    {
+        while (index < 0)
+        {
+            for (int i = 0; i < max_slots && index < 0; i++)
+            {
+                bool free = false;
+                if (slots[i].taken.compare_exchange_strong(free, true))
+                    index = i;
+            }
+            // more threads than slots read at once, wait for one to exit
+            if (index < 0)
+                this_thread::yield();
+        }
+        return index;
+    }
+};
+
+static thread_local ThreadSlot thread_slot;
+
+EpochGuard::EpochGuard()
+{
+    slot = thread_slot.get();
+    outer = thread_slot.depth++ == 0;
+    // seq_cst orders the store before the loads of the guarded pointers
+    if (outer)
+        slots[slot].epoch.store(global_epoch.load());
+}
+
+EpochGuard::~EpochGuard()
+{
+    thread_slot.depth--;
+    if (outer)
+        slots[slot].epoch.store(0, memory_order_release);
+}
+
+void retire(void* obj, void (*destroy)(void*))
+{
+    // readers that entered before this point may hold obj; later ones load
+    // the pointer that replaced it
+    Retired item = {global_epoch.fetch_add(1), obj, destroy};
+    {
+        lock_guard<mutex> guard(retired_lock);
+        retired.push_back(item);
+        if (retired.size() < 32)
+            return;
+    }
+    reclaim();
+}
+
+int reclaim()
+{
+    unsigned long long oldest = global_epoch.load();
+    for (int i = 0; i < max_slots; i++)
+    {
+        unsigned long long epoch = slots[i].epoch.load();
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    vector<Retired> ready;
+    int waiting;
+    {
+        lock_guard<mutex> guard(retired_lock);
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); i++)
+        {
+            if (retired[i].epoch < oldest)
+                ready.push_back(retired[i]);
+            else
+                retired[kept++] = retired[i];
+        }
+        retired.resize(kept);
+        waiting = (int)kept;
+    }
+    for (auto it = ready.begin(); it != ready.end(); it++)
+        it->destroy(it->obj);
+    return waiting;
+}
@@ -0,0 +1,36 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// Epoch based reclamation for structures that readers traverse without locks.
+// A reader holds an EpochGuard while it uses a pointer it loaded from an
+// atomic. A writer that unlinks an object hands it to retire() instead of
+// deleting it, and it is freed once every reader that might still see it has
+// left. Readers never wait: entering and leaving are two stores to a slot of
+// their own.
+
+class EpochGuard {
+public:
+    EpochGuard();
+    ~EpochGuard();
+
+private:
+    EpochGuard(const EpochGuard&);
+    EpochGuard& operator=(const EpochGuard&);
+    int slot;
+    // guards nest, only the outermost one enters and leaves
+    bool outer;
+};
+
+// frees obj with destroy(obj) once no reader can hold it
+void retire(void* obj, void (*destroy)(void*));
+
+template <class T>
+void retire(T* obj)
+{
+    retire(obj, [](void* p) { delete (T*)p; });
+}
+
+// frees what can be freed now, returns the number of objects still waiting
+int reclaim();
+
+#endif
@@ -0,0 +1,500 @@
+#include <cstdio>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "gallery.h"
+#include "epoch.h"
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
+// gallery.bin: this header, then count rows of a uint32 name length, the
+// name and dim floats
+struct GalleryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dim;
+    uint32_t count;
+    uint64_t last_seq;
+};
+
+// a log record: this header, then a uint32 name length, the name and dim
+// floats. crc covers seq and the payload, so a record torn by a crash is
+// recognized and dropped
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t seq;
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+static const uint32_t GALLERY_MAGIC = 0x59524c47;
+static const uint32_t RECORD_MAGIC = 0x4c524e45;
+// a segment is closed once it reaches this size
+static const size_t SEGMENT_BYTES = 4 << 20;
+
+static uint32_t crc32(uint32_t crc, const void* data, size_t size)
+{
+    static uint32_t table[256];
+    static bool ready = false;
+    if (!ready)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        ready = true;
+    }
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static float dot(const float* a, const float* b, int n)
+{
+    int i = 0;
+    float sum = 0;
+#if __SSE2__
+    __m128 s0 = _mm_setzero_ps();
+    __m128 s1 = _mm_setzero_ps();
+    for (; i + 8 <= n; i += 8)
+    {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(s0, s1));
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// makes a rename or unlink in dir durable
+static void syncDir(const string& dir)
+{
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+Gallery::Gallery(const string& dir, int dim)
+    : dir(dir), feature_dim(dim), current(new GallerySnapshot())
+{
+    // the crc table is filled before any thread can race on it
+    crc32(0, 0, 0);
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+        throw runtime_error("cannot create gallery directory " + dir);
+    if (!load())
+    {
+        delete current.load();
+        throw runtime_error("cannot read gallery " + dir);
+    }
+    publish();
+    vector<int> numbers = segments();
+    openSegment(numbers.empty() ? 1 : numbers.back() + 1);
+}
+
+Gallery::~Gallery()
+{
+    {
+        lock_guard<mutex> guard(log_lock);
+        stopping = true;
+    }
+    compact_wanted.notify_all();
+    if (compactor.joinable())
+        compactor.join();
+    if (log_fd >= 0)
+        close(log_fd);
+    // searches still running here would be using a destroyed gallery anyway
+    delete current.load();
+}
+
+string Gallery::segmentPath(int number) const
+{
+    char name[32];
+    sprintf(name, "/wal.%06d", number);
+    return dir + name;
+}
+
+vector<int> Gallery::segments() const
+{
+    vector<int> numbers;
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return numbers;
+    while (dirent* entry = readdir(d))
+    {
+        int number;
+        char tail;
+        if (sscanf(entry->d_name, "wal.%d%c", &number, &tail) == 1)
+            numbers.push_back(number);
+    }
+    closedir(d);
+    sort(numbers.begin(), numbers.end());
+    return numbers;
+}
+
+bool Gallery::load()
+{
+    uint64_t compacted = 0;
+    FILE* fp = fopen((dir + "/gallery.bin").c_str(), "rb");
+    if (fp)
+    {
+        GalleryHeader header;
+        bool ok = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == GALLERY_MAGIC &&
+                  header.version == 1 && (int)header.dim == feature_dim;
+        vector<float> feature(feature_dim);
+        string name;
+        for (uint32_t i = 0; ok && i < header.count; i++)
+        {
+            uint32_t len;
+            ok = fread(&len, sizeof(len), 1, fp) == 1 && len < 65536;
+            if (!ok)
+                break;
+            name.resize(len);
+            ok = (len == 0 || fread(&name[0], len, 1, fp) == 1) &&
+                 fread(feature.data(), sizeof(float), feature_dim, fp) == (size_t)feature_dim;
+            if (ok)
+                append(name, feature.data());
+        }
+        fclose(fp);
+        if (!ok)
+            return false;
+        compacted = header.last_seq;
+    }
+    last_seq = compacted;
+
+    // segments left over from a compaction that was cut short hold nothing
+    // past gallery.bin and are removed, the rest are replayed
+    vector<int> numbers = segments();
+    for (auto it = numbers.begin(); it != numbers.end(); it++)
+    {
+        uint64_t before = last_seq;
+        replay(segmentPath(*it), compacted);
+        if (last_seq == before)
+            unlink(segmentPath(*it).c_str());
+    }
+    return true;
+}
+
+void Gallery::replay(const string& path, uint64_t after)
+{
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0)
+        return;
+    struct stat st;
+    vector<char> data;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        data.resize(st.st_size);
+        if (pread(fd, data.data(), data.size(), 0) != (ssize_t)data.size())
+            data.clear();
+    }
+
+    size_t offset = 0;
+    size_t floats = feature_dim * sizeof(float);
+    string name;
+    while (offset + sizeof(RecordHeader) <= data.size())
+    {
+        RecordHeader header;
+        memcpy(&header, &data[offset], sizeof(header));
+        const char* payload = &data[offset + sizeof(header)];
+        if (header.magic != RECORD_MAGIC || header.size < 4 + floats ||
+            offset + sizeof(header) + header.size > data.size() ||
+            crc32(crc32(0, &header.seq, sizeof(header.seq)), payload, header.size) != header.crc)
+            break;
+        uint32_t len;
+        memcpy(&len, payload, 4);
+        if (4 + len + floats != header.size)
+            break;
+        if (header.seq > after)
+        {
+            name.assign(payload + 4, len);
+            vector<float> feature(feature_dim);
+            memcpy(feature.data(), payload + 4 + len, floats);
+            append(name, feature.data());
+            last_seq = max(last_seq, header.seq);
+        }
+        offset += sizeof(header) + header.size;
+    }
+    // a torn record at the end, cut off so later appends follow whole ones
+    if (offset < data.size())
+        ftruncate(fd, offset);
+    close(fd);
+}
+
+void Gallery::openSegment(int number)
+{
+    int fd = open(segmentPath(number).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        throw runtime_error("cannot open log segment " + segmentPath(number));
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = fd;
+    segment = number;
+    segment_bytes = 0;
+    syncDir(dir);
+}
+
+void Gallery::append(const string& name, const float* feature)
+{
+    if (count == (int)blocks.size() * GalleryBlock::rows)
+        blocks.push_back(unique_ptr<GalleryBlock>(new GalleryBlock(feature_dim)));
+    GalleryBlock& block = *blocks[count / GalleryBlock::rows];
+    int row = count % GalleryBlock::rows;
+    memcpy(&block.features[row * feature_dim], feature, feature_dim * sizeof(float));
+    block.names[row] = name;
+    count++;
+}
+
+void Gallery::publish()
+{
+    GallerySnapshot* next = new GallerySnapshot();
+    next->blocks.reserve(blocks.size());
+    for (auto it = blocks.begin(); it != blocks.end(); it++)
+        next->blocks.push_back(it->get());
+    next->count = count;
+    retire(current.exchange(next));
+}
+
+int Gallery::enroll(const string& name, const vector<float>& feature, bool sync)
+{
+    if ((int)feature.size() != feature_dim || name.size() >= 65536)
+        return -1;
+
+    uint32_t len = name.size();
+    vector<char> record(sizeof(RecordHeader) + 4 + len + feature_dim * sizeof(float));
+    char* payload = &record[sizeof(RecordHeader)];
+    memcpy(payload, &len, 4);
+    memcpy(payload + 4, name.data(), len);
+    memcpy(payload + 4 + len, feature.data(), feature_dim * sizeof(float));
+
+    unique_lock<mutex> guard(log_lock);
+    // replay stops at a torn record, nothing may follow one in its segment
+    if (log_torn)
+    {
+        try
+        {
+            openSegment(segment + 1);
+        }
+        catch (const runtime_error&)
+        {
+            return -1;
+        }
+        log_torn = false;
+    }
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.size = record.size() - sizeof(RecordHeader);
+    header.seq = last_seq + 1;
+    header.crc = crc32(crc32(0, &header.seq, sizeof(header.seq)), payload, header.size);
+    header.reserved = 0;
+    memcpy(&record[0], &header, sizeof(header));
+    off_t start = lseek(log_fd, 0, SEEK_END);
+    if (start < 0)
+        return -1;
+    if (!writeAll(log_fd, record.data(), record.size()) || (sync && fdatasync(log_fd) < 0))
+    {
+        // the record is cut off again and its row never published, so a
+        // failed enrollment cannot come back on the next open
+        log_torn = ftruncate(log_fd, start) < 0;
+        return -1;
+    }
+    last_seq = header.seq;
+    segment_bytes += record.size();
+    log_bytes += record.size();
+
+    // rows are added in log order, which compact() relies on
+    append(name, feature.data());
+    publish();
+    int id = count - 1;
+    if (segment_bytes >= SEGMENT_BYTES)
+    {
+        // the record is in, a segment that cannot be opened now is opened
+        // by the next enrollment instead
+        try
+        {
+            openSegment(segment + 1);
+        }
+        catch (const runtime_error&)
+        {
+            log_torn = true;
+        }
+    }
+    if (auto_compact > 0 && log_bytes >= auto_compact)
+        compact_wanted.notify_one();
+    return id;
+}
+
+vector<GalleryMatch> Gallery::search(const vector<float>& feature, int k) const
+{
+    if ((int)feature.size() != feature_dim || k <= 0)
+        return vector<GalleryMatch>();
+    EpochGuard guard;
+    const GallerySnapshot* snapshot = current.load();
+    int n = snapshot->count;
+
+    // (similarity, row), best first
+    vector<pair<float, int> > best;
+    const float* query = feature.data();
+    for (int b = 0; b * GalleryBlock::rows < n; b++)
+    {
+        const float* rows = snapshot->blocks[b]->features.data();
+        int m = min(GalleryBlock::rows, n - b * GalleryBlock::rows);
+        for (int r = 0; r < m; r++)
+        {
+            float sim = dot(query, rows + r * feature_dim, feature_dim);
+            if ((int)best.size() == k && sim <= best.back().first)
+                continue;
+            pair<float, int> match(sim, b * GalleryBlock::rows + r);
+            best.insert(upper_bound(best.begin(), best.end(), match, greater<pair<float, int> >()), match);
+            if ((int)best.size() > k)
+                best.pop_back();
+        }
+    }
+
+    vector<GalleryMatch> matches(best.size());
+    for (size_t i = 0; i < best.size(); i++)
+    {
+        int id = best[i].second;
+        matches[i].id = id;
+        matches[i].name = snapshot->blocks[id / GalleryBlock::rows]->names[id % GalleryBlock::rows];
+        matches[i].similarity = best[i].first;
+    }
+    return matches;
+}
+
+int Gallery::size() const
+{
+    EpochGuard guard;
+    return current.load()->count;
+}
+
+bool Gallery::compact()
+{
+    lock_guard<mutex> compacting(compact_lock);
+    int closed;
+    uint64_t seq;
+    size_t logged;
+    vector<const GalleryBlock*> snapshot;
+    int n;
+    {
+        // every row up to count is in the segments up to closed
+        lock_guard<mutex> guard(log_lock);
+        if (log_bytes == 0)
+            return true;
+        closed = segment;
+        seq = last_seq;
+        logged = log_bytes;
+        try
+        {
+            openSegment(segment + 1);
+        }
+        catch (const runtime_error&)
+        {
+            return false;
+        }
+        log_bytes = 0;
+        for (auto it = blocks.begin(); it != blocks.end(); it++)
+            snapshot.push_back(it->get());
+        n = count;
+    }
+
+    // the rows are written outside the lock, the blocks stay where they are
+    string tmp = dir + "/gallery.bin.tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    bool ok = fp != 0;
+    if (ok)
+    {
+        GalleryHeader header = {GALLERY_MAGIC, 1, (uint32_t)feature_dim, (uint32_t)n, seq};
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        for (int i = 0; ok && i < n; i++)
+        {
+            const GalleryBlock& block = *snapshot[i / GalleryBlock::rows];
+            int row = i % GalleryBlock::rows;
+            uint32_t len = block.names[row].size();
+            ok = fwrite(&len, sizeof(len), 1, fp) == 1 &&
+                 fwrite(block.names[row].data(), 1, len, fp) == len &&
+                 fwrite(&block.features[row * feature_dim], sizeof(float), feature_dim, fp) == (size_t)feature_dim;
+        }
+        ok = fflush(fp) == 0 && ok && fsync(fileno(fp)) == 0;
+        ok = fclose(fp) == 0 && ok;
+    }
+    if (!ok || rename(tmp.c_str(), (dir + "/gallery.bin").c_str()) < 0)
+    {
+        unlink(tmp.c_str());
+        // the segments are kept, so the next attempt covers these rows again
+        lock_guard<mutex> guard(log_lock);
+        log_bytes += logged;
+        return false;
+    }
+    syncDir(dir);
+
+    vector<int> numbers = segments();
+    for (auto it = numbers.begin(); it != numbers.end() && *it <= closed; it++)
+        unlink(segmentPath(*it).c_str());
+    return true;
+}
+
+void Gallery::setAutoCompact(size_t log_bytes)
+{
+    lock_guard<mutex> guard(log_lock);
+    auto_compact = log_bytes;
+    if (log_bytes > 0 && !compactor.joinable())
+        compactor = thread(&Gallery::compactLoop, this);
+    compact_wanted.notify_one();
+}
+
+void Gallery::compactLoop()
+{
+    unique_lock<mutex> guard(log_lock);
+    while (!stopping)
+    {
+        if (auto_compact == 0 || log_bytes < auto_compact)
+        {
+            compact_wanted.wait(guard);
+            continue;
+        }
+        guard.unlock();
+        bool ok = compact();
+        guard.lock();
+        // a full disk is not retried in a busy loop
+        if (!ok && !stopping)
+            compact_wanted.wait_for(guard, chrono::seconds(1));
+    }
+}
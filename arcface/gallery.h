@@ -0,0 +1,110 @@
+#ifndef GALLERY_H
+#define GALLERY_H
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <condition_variable>
+
+using namespace std;
+
+// rows of the gallery, filled in order and never moved or freed while the
+// gallery is open, so the rows a snapshot counts stay valid while later rows
+// are written
+struct GalleryBlock {
+    static const int rows = 1024;
+    vector<float> features;
+    vector<string> names;
+
+    GalleryBlock(int dim) : features(rows * dim), names(rows) {}
+};
+
+// the rows published to searches at one point
+struct GallerySnapshot {
+    vector<const GalleryBlock*> blocks;
+    int count = 0;
+};
+
+struct GalleryMatch {
+    int id;
+    string name;
+    float similarity;
+};
+
+// Identities with their features, kept in directory dir. Enrollment appends
+// to a write-ahead log of numbered segments, and the face can be searched as
+// soon as enroll() returns. compact() folds the closed segments into
+// gallery.bin, which records the last sequence number it holds, and deletes
+// them. Opening the gallery loads gallery.bin and replays only the segments
+// written since.
+// Searches take no lock: they read the current snapshot through an atomic
+// pointer under an EpochGuard. Every enrollment publishes a new snapshot and
+// retires the old one, which is freed once no search can still be using it.
+class Gallery {
+public:
+    // throws runtime_error when the directory or its files cannot be used
+    Gallery(const string& dir, int dim = 128);
+    ~Gallery();
+
+    // returns the id of the new row. sync waits for the record to reach
+    // the disk. -1 when the record could not be written, which leaves the
+    // gallery and its log as they were
+    int enroll(const string& name, const vector<float>& feature, bool sync = true);
+
+    // the k most similar rows, best first. features are compared as by
+    // calcSimilar, so both sides are expected to be normalized
+    vector<GalleryMatch> search(const vector<float>& feature, int k = 1) const;
+
+    int size() const;
+    int dim() const { return feature_dim; }
+
+    // returns false on a write error, which leaves the log as it was
+    bool compact();
+    // compacts in a background thread whenever the log has grown by
+    // log_bytes since the last compaction, 0 = only when compact() is called
+    void setAutoCompact(size_t log_bytes);
+
+private:
+    string dir;
+    int feature_dim;
+
+    // rows in memory, from gallery.bin and then from the log. written under
+    // log_lock, searches only see them through current
+    vector<unique_ptr<GalleryBlock> > blocks;
+    int count = 0;
+    atomic<GallerySnapshot*> current;
+
+    // the open log segment, and the sequence numbers of the records in it
+    mutex log_lock;
+    int log_fd = -1;
+    int segment = 0;
+    size_t segment_bytes = 0;
+    uint64_t last_seq = 0;
+    // bytes logged since the last compaction
+    size_t log_bytes = 0;
+    // the next record goes to a new segment: a failed record could not be
+    // cut off the open one, or the new segment could not be opened when the
+    // open one filled up
+    bool log_torn = false;
+
+    mutex compact_lock;
+    thread compactor;
+    condition_variable compact_wanted;
+    size_t auto_compact = 0;
+    bool stopping = false;
+
+    void append(const string& name, const float* feature);
+    void publish();
+    bool load();
+    void replay(const string& path, uint64_t after);
+    void openSegment(int number);
+    string segmentPath(int number) const;
+    vector<int> segments() const;
+    void compactLoop();
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "mtcnn.h"
+#include "jpegimage.h"
+#include "synth.h"
+using namespace std;
+
+// Writes synthetic benchmark frames, every combination of frame size and face
+// count, with the faces of the photos in --images pasted onto them, and
+// manifest.json with the pasted boxes and landmarks of every frame.
+
+struct GenOptions {
+    string out;
+    string images = "../image";
+    string model_folder = "../models";
+    string sizes = "640x480,1280x720,1920x1080,3840x2160,7680x4320";
+    string faces = "1,4,16,64";
+    int min_face = 40;
+    int max_face = 160;
+    int frames = 1;
+    unsigned int seed = 1;
+    int quality = 90;
+};
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s --out DIR [--images DIR] [--models DIR] [--sizes WxH,...] [--faces N,...]\n"
+            "       [--face-size MIN,MAX] [--frames N] [--seed N] [--quality Q]\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+    GenOptions opt;
+    bool ok = true;
+    for (int i = 1; i < argc && ok; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--out" && i + 1 < argc)
+            opt.out = argv[++i];
+        else if (arg == "--images" && i + 1 < argc)
+            opt.images = argv[++i];
+        else if (arg == "--models" && i + 1 < argc)
+            opt.model_folder = argv[++i];
+        else if (arg == "--sizes" && i + 1 < argc)
+            opt.sizes = argv[++i];
+        else if (arg == "--faces" && i + 1 < argc)
+            opt.faces = argv[++i];
+        else if (arg == "--face-size" && i + 1 < argc)
+            ok = sscanf(argv[++i], "%d,%d", &opt.min_face, &opt.max_face) == 2;
+        else if (arg == "--frames" && i + 1 < argc)
+            opt.frames = atoi(argv[++i]);
+        else if (arg == "--seed" && i + 1 < argc)
+            opt.seed = strtoul(argv[++i], 0, 10);
+        else if (arg == "--quality" && i + 1 < argc)
+            opt.quality = atoi(argv[++i]);
+        else
+            ok = false;
+    }
+    vector<pair<int, int> > sizes;
+    vector<int> counts;
+    if (!ok || opt.out.empty() || !parseSizeList(opt.sizes, sizes) || !parseIntList(opt.faces, counts) ||
+        opt.min_face < 12 || opt.max_face < opt.min_face || opt.frames <= 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    vector<string> paths;
+    DIR* d = opendir(opt.images.c_str());
+    if (d)
+    {
+        while (dirent* entry = readdir(d))
+        {
+            string name = entry->d_name;
+            size_t dot = name.rfind('.');
+            string ext = dot == string::npos ? "" : name.substr(dot + 1);
+            if (ext == "jpg" || ext == "jpeg" || ext == "JPG" || ext == "JPEG")
+                paths.push_back(opt.images + "/" + name);
+        }
+        closedir(d);
+    }
+    sort(paths.begin(), paths.end());
+    MtcnnDetector detector(opt.model_folder);
+    vector<FaceSource> sources = loadFaceSources(detector, paths);
+    if (sources.empty())
+    {
+        fprintf(stderr, "no faces found in %s\n", opt.images.c_str());
+        return -1;
+    }
+    mkdir(opt.out.c_str(), 0755);
+
+    FILE* manifest = fopen((opt.out + "/manifest.json").c_str(), "w");
+    if (!manifest)
+    {
+        fprintf(stderr, "cannot write %s/manifest.json\n", opt.out.c_str());
+        return -1;
+    }
+    fprintf(manifest, "{\n  \"seed\": %u,\n  \"face_size\": [%d, %d],\n  \"frames\": [\n",
+            opt.seed, opt.min_face, opt.max_face);
+    bool first = true;
+    vector<FaceInfo> truth;
+    for (auto size = sizes.begin(); size != sizes.end(); size++)
+    {
+        for (auto count = counts.begin(); count != counts.end(); count++)
+        {
+            for (int f = 0; f < opt.frames; f++)
+            {
+                FrameSpec spec;
+                spec.width = size->first;
+                spec.height = size->second;
+                spec.faces = *count;
+                spec.min_face = opt.min_face;
+                spec.max_face = opt.max_face;
+                spec.seed = opt.seed + f;
+                vector<unsigned char> frame = composeFrame(sources, spec, truth);
+
+                char name[64];
+                sprintf(name, "%dx%d_%df_%d.jpg", spec.width, spec.height, spec.faces, f);
+                if (!writeJpeg(opt.out + "/" + name, frame.data(), spec.width, spec.height, opt.quality))
+                {
+                    fprintf(stderr, "cannot write %s/%s\n", opt.out.c_str(), name);
+                    fclose(manifest);
+                    return -1;
+                }
+                fprintf(manifest, "%s    {\"file\": \"%s\", \"width\": %d, \"height\": %d, \"faces\": [",
+                        first ? "" : ",\n", name, spec.width, spec.height);
+                first = false;
+                for (size_t i = 0; i < truth.size(); i++)
+                {
+                    const FaceInfo& t = truth[i];
+                    fprintf(manifest, "%s\n      {\"box\": [%d, %d, %d, %d], \"landmarks\": [", i ? "," : "",
+                            t.x[0], t.y[0], t.x[1], t.y[1]);
+                    for (int k = 0; k < 10; k++)
+                        fprintf(manifest, "%s%d", k ? ", " : "", t.landmark[k]);
+                    fprintf(manifest, "]}");
+                }
+                fprintf(manifest, "%s]}", truth.empty() ? "" : "\n    ");
+                fprintf(stderr, "%s: %d of %d faces placed\n", name, (int)truth.size(), spec.faces);
+            }
+        }
+    }
+    fprintf(manifest, "\n  ]\n}\n");
+    fclose(manifest);
+    return 0;
+}
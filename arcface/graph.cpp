@@ -0,0 +1,624 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "graph.h"
+
+static const unsigned int FP16_TAG = 0x01306B47;
+static const unsigned int TABLE_TAG = 0x000D4B38;
+
+int GraphLayer::getInt(int id, int def) const
+{
+    for (auto it = params.begin(); it != params.end(); it++)
+        if (it->first == id)
+            return atoi(it->second.c_str());
+    return def;
+}
+
+float GraphLayer::getFloat(int id, float def) const
+{
+    for (auto it = params.begin(); it != params.end(); it++)
+        if (it->first == id)
+            return (float)atof(it->second.c_str());
+    return def;
+}
+
+void GraphLayer::set(int id, int v)
+{
+    char buf[32];
+    sprintf(buf, "%d", v);
+    for (auto it = params.begin(); it != params.end(); it++)
+        if (it->first == id)
+        {
+            it->second = buf;
+            return;
+        }
+    params.push_back(make_pair(id, string(buf)));
+}
+
+void GraphLayer::set(int id, float v)
+{
+    // ncnn tells floats from ints by the decimal point or exponent
+    char buf[32];
+    sprintf(buf, "%.9e", v);
+    for (auto it = params.begin(); it != params.end(); it++)
+        if (it->first == id)
+        {
+            it->second = buf;
+            return;
+        }
+    params.push_back(make_pair(id, string(buf)));
+}
+
+// weight blobs a layer reads from the model file, as (count, raw) in load order
+static int weightLayout(const GraphLayer& layer, vector<pair<int, bool> >& blobs)
+{
+    static const char* weightless[] = {
+        "Input", "Split", "Slice", "Concat", "Pooling", "Softmax", "BinaryOp", "UnaryOp",
+        "Eltwise", "Dropout", "ReLU", "Sigmoid", "TanH", "Flatten", "Reshape", "Crop", "Padding",
+    };
+    const string& type = layer.type;
+    if (type == "Convolution" || type == "ConvolutionDepthWise")
+    {
+        blobs.push_back(make_pair(layer.getInt(6, 0), false));
+        if (layer.getInt(5, 0))
+            blobs.push_back(make_pair(layer.getInt(0, 0), true));
+        return 0;
+    }
+    if (type == "ConvolutionInt8" || type == "ConvolutionDepthWiseInt8")
+    {
+        // int8 weights four to a word, per channel scales, bias
+        blobs.push_back(make_pair((layer.getInt(6, 0) + 3) / 4, true));
+        blobs.push_back(make_pair(layer.getInt(0, 0), true));
+        if (layer.getInt(5, 0))
+            blobs.push_back(make_pair(layer.getInt(0, 0), true));
+        return 0;
+    }
+    if (type == "InnerProduct")
+    {
+        blobs.push_back(make_pair(layer.getInt(2, 0), false));
+        if (layer.getInt(1, 0))
+            blobs.push_back(make_pair(layer.getInt(0, 0), true));
+        return 0;
+    }
+    if (type == "BatchNorm")
+    {
+        // slope, mean, var, bias
+        for (int i = 0; i < 4; i++)
+            blobs.push_back(make_pair(layer.getInt(0, 0), true));
+        return 0;
+    }
+    if (type == "PReLU")
+    {
+        blobs.push_back(make_pair(layer.getInt(0, 0), true));
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(weightless) / sizeof(weightless[0]); i++)
+        if (type == weightless[i])
+            return 0;
+    fprintf(stderr, "graph: unsupported layer type %s\n", type.c_str());
+    return -1;
+}
+
+static int readWeight(FILE* fp, int count, bool raw, ncnn::Mat& m)
+{
+    m.create(count);
+    if (raw)
+        return fread(m.data, sizeof(float), count, fp) == (size_t)count ? 0 : -1;
+
+    unsigned int flag;
+    if (fread(&flag, sizeof(flag), 1, fp) != 1)
+        return -1;
+    if (flag == FP16_TAG)
+    {
+        vector<unsigned short> half(count + 1);
+        if (fread(half.data(), sizeof(unsigned short), count, fp) != (size_t)count)
+            return -1;
+        if (count % 2)
+            fseek(fp, sizeof(unsigned short), SEEK_CUR);
+        m = ncnn::Mat::from_float16(half.data(), count);
+        return 0;
+    }
+    if (flag != 0)
+    {
+        // quantized, 256 entry table followed by uint8 indexes padded to 4 bytes
+        float table[256];
+        vector<unsigned char> index(count);
+        if (fread(table, sizeof(float), 256, fp) != 256 || fread(index.data(), 1, count, fp) != (size_t)count)
+            return -1;
+        if (count % 4)
+            fseek(fp, 4 - count % 4, SEEK_CUR);
+        for (int i = 0; i < count; i++)
+            m[i] = table[index[i]];
+        return 0;
+    }
+    return fread(m.data, sizeof(float), count, fp) == (size_t)count ? 0 : -1;
+}
+
+int ModelGraph::load(const string& param_file, const string& bin_file)
+{
+    layers.clear();
+
+    ifstream param(param_file.c_str());
+    if (!param)
+        return -1;
+    int magic = 0, layer_count = 0, blob_count = 0;
+    param >> magic >> layer_count >> blob_count;
+    if (magic != 7767517)
+        return -1;
+    string line;
+    getline(param, line);
+    for (int i = 0; i < layer_count; i++)
+    {
+        if (!getline(param, line))
+            return -1;
+        istringstream ss(line);
+        GraphLayer layer;
+        int bottom_count = 0, top_count = 0;
+        ss >> layer.type >> layer.name >> bottom_count >> top_count;
+        layer.bottoms.resize(bottom_count);
+        layer.tops.resize(top_count);
+        for (int j = 0; j < bottom_count; j++)
+            ss >> layer.bottoms[j];
+        for (int j = 0; j < top_count; j++)
+            ss >> layer.tops[j];
+        string token;
+        while (ss >> token)
+        {
+            size_t eq = token.find('=');
+            if (eq == string::npos)
+                return -1;
+            layer.params.push_back(make_pair(atoi(token.substr(0, eq).c_str()), token.substr(eq + 1)));
+        }
+        layers.push_back(layer);
+    }
+
+    FILE* fp = fopen(bin_file.c_str(), "rb");
+    if (!fp)
+        return -1;
+    int ret = 0;
+    for (auto it = layers.begin(); it != layers.end() && ret == 0; it++)
+    {
+        vector<pair<int, bool> > blobs;
+        ret = weightLayout(*it, blobs);
+        for (auto b = blobs.begin(); b != blobs.end() && ret == 0; b++)
+        {
+            ncnn::Mat m;
+            ret = readWeight(fp, b->first, b->second, m);
+            it->weights.push_back(m);
+            it->raw.push_back(b->second);
+        }
+    }
+    // anything left over means the layout guess was wrong
+    if (ret == 0 && fgetc(fp) != EOF)
+        ret = -1;
+    fclose(fp);
+    if (ret != 0)
+        layers.clear();
+    return ret;
+}
+
+string ModelGraph::toParam() const
+{
+    vector<string> blobs;
+    for (auto it = layers.begin(); it != layers.end(); it++)
+        blobs.insert(blobs.end(), it->tops.begin(), it->tops.end());
+    sort(blobs.begin(), blobs.end());
+    blobs.erase(unique(blobs.begin(), blobs.end()), blobs.end());
+
+    ostringstream ss;
+    ss << 7767517 << "\n" << layers.size() << " " << blobs.size() << "\n";
+    for (auto it = layers.begin(); it != layers.end(); it++)
+    {
+        ss << it->type << " " << it->name << " " << it->bottoms.size() << " " << it->tops.size();
+        for (auto b = it->bottoms.begin(); b != it->bottoms.end(); b++)
+            ss << " " << *b;
+        for (auto t = it->tops.begin(); t != it->tops.end(); t++)
+            ss << " " << *t;
+        for (auto p = it->params.begin(); p != it->params.end(); p++)
+            ss << " " << p->first << "=" << p->second;
+        ss << "\n";
+    }
+    return ss.str();
+}
+
+template<typename T>
+static void append(vector<unsigned char>& bin, const T* data, size_t count)
+{
+    bin.insert(bin.end(), (const unsigned char*)data, (const unsigned char*)(data + count));
+}
+
+// 256 evenly spaced levels between the extremes, the ncnn 8-bit weight format
+static void appendTable(vector<unsigned char>& bin, const ncnn::Mat& m)
+{
+    const float* ptr = m;
+    float lo = *min_element(ptr, ptr + m.w);
+    float hi = *max_element(ptr, ptr + m.w);
+    float step = hi > lo ? (hi - lo) / 255.f : 1.f;
+    float table[256];
+    for (int i = 0; i < 256; i++)
+        table[i] = lo + step * i;
+    vector<unsigned char> index((m.w + 3) / 4 * 4, 0);
+    for (int i = 0; i < m.w; i++)
+        index[i] = (unsigned char)min(255, (int)roundf((ptr[i] - lo) / step));
+    append(bin, &TABLE_TAG, 1);
+    append(bin, table, 256);
+    append(bin, index.data(), index.size());
+}
+
+// round to nearest even, overflow saturates to infinity
+static unsigned short toHalf(float value)
+{
+    unsigned int x;
+    memcpy(&x, &value, sizeof(x));
+    unsigned short sign = (x >> 16) & 0x8000;
+    unsigned int exponent = (x >> 23) & 0xff;
+    unsigned int mantissa = x & 0x7fffff;
+
+    if (exponent == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    int e = (int)exponent - 127 + 15;
+    if (e >= 31)
+        return sign | 0x7c00;
+    if (e <= 0)
+    {
+        // subnormal half, or zero below half the smallest subnormal
+        if (e < -10)
+            return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - e;
+        unsigned int half = mantissa >> shift;
+        unsigned int rest = mantissa & ((1u << shift) - 1);
+        unsigned int midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    unsigned int half = (e << 10) | (mantissa >> 13);
+    unsigned int rest = mantissa & 0x1fff;
+    // a carry out of the mantissa correctly bumps the exponent
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | half;
+}
+
+static void appendHalf(vector<unsigned char>& bin, const ncnn::Mat& m)
+{
+    const float* ptr = m;
+    vector<unsigned short> half((m.w + 1) / 2 * 2, 0);
+    for (int i = 0; i < m.w; i++)
+        half[i] = toHalf(ptr[i]);
+    append(bin, &FP16_TAG, 1);
+    append(bin, half.data(), half.size());
+}
+
+void ModelGraph::toBin(vector<unsigned char>& bin, WeightFormat format) const
+{
+    bin.clear();
+    for (auto it = layers.begin(); it != layers.end(); it++)
+    {
+        for (size_t i = 0; i < it->weights.size(); i++)
+        {
+            const ncnn::Mat& m = it->weights[i];
+            if (it->raw[i])
+            {
+                append(bin, (const float*)m.data, m.w);
+                continue;
+            }
+            if (format == WEIGHT_TABLE && m.w > 256)
+            {
+                appendTable(bin, m);
+                continue;
+            }
+            if (format == WEIGHT_FP16)
+            {
+                appendHalf(bin, m);
+                continue;
+            }
+            unsigned int flag = 0;
+            append(bin, &flag, 1);
+            append(bin, (const float*)m.data, m.w);
+        }
+    }
+}
+
+int ModelGraph::save(const string& param_file, const string& bin_file, WeightFormat format) const
+{
+    string param = toParam();
+    vector<unsigned char> bin;
+    toBin(bin, format);
+
+    FILE* fp = fopen(param_file.c_str(), "wb");
+    if (!fp)
+        return -1;
+    fwrite(param.data(), 1, param.size(), fp);
+    fclose(fp);
+
+    fp = fopen(bin_file.c_str(), "wb");
+    if (!fp)
+        return -1;
+    size_t written = fwrite(bin.data(), 1, bin.size(), fp);
+    fclose(fp);
+    return written == bin.size() ? 0 : -1;
+}
+
+int ModelGraph::loadInto(ncnn::Net& net) const
+{
+    string param = toParam();
+    vector<unsigned char> bin;
+    toBin(bin, WEIGHT_FP32);
+    // fmemopen rejects empty buffers
+    if (bin.empty())
+        bin.resize(4);
+
+    FILE* fp = fmemopen((void*)param.data(), param.size(), "rb");
+    if (!fp)
+        return -1;
+    int ret = net.load_param(fp);
+    fclose(fp);
+    if (ret != 0)
+        return ret;
+
+    fp = fmemopen(bin.data(), bin.size(), "rb");
+    if (!fp)
+        return -1;
+    ret = net.load_model(fp);
+    fclose(fp);
+    return ret;
+}
+
+int ModelGraph::findProducer(const string& blob) const
+{
+    for (size_t i = 0; i < layers.size(); i++)
+        if (find(layers[i].tops.begin(), layers[i].tops.end(), blob) != layers[i].tops.end())
+            return (int)i;
+    return -1;
+}
+
+vector<int> ModelGraph::findConsumers(const string& blob) const
+{
+    vector<int> consumers;
+    for (size_t i = 0; i < layers.size(); i++)
+        if (find(layers[i].bottoms.begin(), layers[i].bottoms.end(), blob) != layers[i].bottoms.end())
+            consumers.push_back((int)i);
+    return consumers;
+}
+
+int ModelGraph::foldBatchNorm()
+{
+    int removed = 0;
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        GraphLayer& bn = layers[i];
+        if (bn.type != "BatchNorm" || bn.bottoms.size() != 1 || bn.weights.size() != 4)
+            continue;
+        int p = findProducer(bn.bottoms[0]);
+        if (p < 0 || findConsumers(bn.bottoms[0]).size() != 1)
+            continue;
+        GraphLayer& conv = layers[p];
+        bool ip = conv.type == "InnerProduct";
+        if (!ip && conv.type != "Convolution" && conv.type != "ConvolutionDepthWise")
+            continue;
+        int num_output = conv.getInt(0, 0);
+        int channels = bn.getInt(0, 0);
+        if (channels != num_output || num_output <= 0)
+            continue;
+        float eps = bn.getFloat(1, 0.f);
+
+        int bias_id = ip ? 1 : 5;
+        if (!conv.getInt(bias_id, 0))
+        {
+            ncnn::Mat bias(num_output);
+            bias.fill(0.f);
+            conv.weights.push_back(bias);
+            conv.raw.push_back(true);
+            conv.set(bias_id, 1);
+        }
+
+        ncnn::Mat& weight = conv.weights[0];
+        ncnn::Mat& bias = conv.weights[1];
+        const float* slope = bn.weights[0];
+        const float* mean = bn.weights[1];
+        const float* var = bn.weights[2];
+        const float* shift = bn.weights[3];
+        int size = weight.w / num_output;
+        for (int o = 0; o < num_output; o++)
+        {
+            float sqrt_var = sqrt(var[o] + eps);
+            float b = slope[o] / sqrt_var;
+            float a = shift[o] - slope[o] * mean[o] / sqrt_var;
+            float* w = (float*)weight.data + o * size;
+            for (int k = 0; k < size; k++)
+                w[k] *= b;
+            bias[o] = bias[o] * b + a;
+        }
+
+        conv.tops[0] = bn.tops[0];
+        layers.erase(layers.begin() + i);
+        i--;
+        removed++;
+    }
+    return removed;
+}
+
+int ModelGraph::foldInput(const string& blob, const float* mean_vals, const float* norm_vals, bool swap_rb)
+{
+    // per channel transform (x - mean) * norm, repeating every 3 channels
+    float mean[3] = {0.f, 0.f, 0.f};
+    float norm[3] = {1.f, 1.f, 1.f};
+    for (int c = 0; c < 3; c++)
+    {
+        if (mean_vals)
+            mean[c] = mean_vals[c];
+        if (norm_vals)
+            norm[c] = norm_vals[c];
+    }
+
+    // absorb scalar arithmetic right behind the input
+    vector<int> absorbed;
+    string head = blob;
+    for (;;)
+    {
+        vector<int> consumers = findConsumers(head);
+        if (consumers.size() != 1)
+            break;
+        const GraphLayer& op = layers[consumers[0]];
+        if (op.type != "BinaryOp" || op.getInt(1, 0) != 1 || op.tops.size() != 1)
+            break;
+        int op_type = op.getInt(0, 0);
+        float b = op.getFloat(2, 0.f);
+        if (op_type > 3 || (op_type == 3 && b == 0.f))
+            break;
+        for (int c = 0; c < 3; c++)
+        {
+            if (op_type == 0)
+                mean[c] -= b / norm[c];
+            else if (op_type == 1)
+                mean[c] += b / norm[c];
+            else if (op_type == 2)
+                norm[c] *= b;
+            else
+                norm[c] /= b;
+        }
+        absorbed.push_back(consumers[0]);
+        head = op.tops[0];
+    }
+
+    bool uniform = mean[0] == mean[1] && mean[1] == mean[2] && norm[0] == norm[1] && norm[1] == norm[2];
+
+    // the convolutions reading the input, seen through Split and Slice
+    vector<int> targets;
+    vector<string> pending(1, head);
+    while (!pending.empty())
+    {
+        string b = pending.back();
+        pending.pop_back();
+        vector<int> consumers = findConsumers(b);
+        for (auto it = consumers.begin(); it != consumers.end(); it++)
+        {
+            const GraphLayer& layer = layers[*it];
+            bool slice = layer.type == "Slice";
+            if (layer.type == "Split" || (slice && uniform && !swap_rb))
+                pending.insert(pending.end(), layer.tops.begin(), layer.tops.end());
+            else if (layer.type == "Convolution" || layer.type == "ConvolutionDepthWise")
+                targets.push_back(*it);
+            else
+                return -1;
+        }
+    }
+    if (targets.empty())
+        return -1;
+
+    bool fold_mean = true;
+    for (auto it = targets.begin(); it != targets.end(); it++)
+    {
+        const GraphLayer& conv = layers[*it];
+        int group = conv.type == "ConvolutionDepthWise" ? conv.getInt(7, 1) : 1;
+        int kernel_w = conv.getInt(1, 0);
+        int maxk = kernel_w * conv.getInt(11, kernel_w);
+        if (swap_rb && (group != 1 || conv.weights[0].w != conv.getInt(0, 0) * 3 * maxk))
+            return -1;
+        int pad_w = conv.getInt(4, 0);
+        if (pad_w != 0 || conv.getInt(14, pad_w) != 0)
+            fold_mean = false;
+    }
+    bool zero_mean = mean[0] == 0.f && mean[1] == 0.f && mean[2] == 0.f;
+    if (!fold_mean && !zero_mean && !(mean[0] == mean[1] && mean[1] == mean[2]))
+        return -1;
+
+    for (auto it = targets.begin(); it != targets.end(); it++)
+    {
+        GraphLayer& conv = layers[*it];
+        int num_output = conv.getInt(0, 0);
+        int kernel_w = conv.getInt(1, 0);
+        int maxk = kernel_w * conv.getInt(11, kernel_w);
+        int group = conv.type == "ConvolutionDepthWise" ? conv.getInt(7, 1) : 1;
+        ncnn::Mat& weight = conv.weights[0];
+        int inpg = weight.w / (num_output * maxk);
+        int outpg = num_output / group;
+
+        vector<double> shift(num_output, 0.0);
+        ncnn::Mat folded(weight.w);
+        for (int o = 0; o < num_output; o++)
+        {
+            int g = o / outpg;
+            for (int c = 0; c < inpg; c++)
+            {
+                int src_c = swap_rb ? inpg - 1 - c : c;
+                int channel = (g * inpg + src_c) % 3;
+                const float* src = (const float*)weight.data + (o * inpg + src_c) * maxk;
+                float* dst = (float*)folded.data + (o * inpg + c) * maxk;
+                for (int k = 0; k < maxk; k++)
+                {
+                    dst[k] = src[k] * norm[channel];
+                    shift[o] += (double)dst[k] * mean[channel];
+                }
+            }
+        }
+        weight = folded;
+
+        if (fold_mean && !zero_mean)
+        {
+            if (!conv.getInt(5, 0))
+            {
+                ncnn::Mat bias(num_output);
+                bias.fill(0.f);
+                conv.weights.push_back(bias);
+                conv.raw.push_back(true);
+                conv.set(5, 1);
+            }
+            ncnn::Mat& bias = conv.weights[1];
+            for (int o = 0; o < num_output; o++)
+                bias[o] -= (float)shift[o];
+        }
+    }
+
+    // drop the absorbed layers, the input now feeds what they fed
+    for (auto it = layers.begin(); it != layers.end(); it++)
+        for (auto b = it->bottoms.begin(); b != it->bottoms.end(); b++)
+            if (*b == head)
+                *b = blob;
+    int removed = (int)absorbed.size();
+    sort(absorbed.rbegin(), absorbed.rend());
+    for (auto it = absorbed.begin(); it != absorbed.end(); it++)
+        layers.erase(layers.begin() + *it);
+
+    if (!fold_mean && !zero_mean)
+    {
+        // zero padding happens after the mean subtraction, which has to stay in the graph
+        GraphLayer sub;
+        sub.type = "BinaryOp";
+        sub.name = blob + "_sub";
+        sub.bottoms.push_back(blob);
+        sub.tops.push_back(sub.name);
+        sub.set(0, 1);
+        sub.set(1, 1);
+        sub.set(2, mean[0]);
+        for (auto it = layers.begin(); it != layers.end(); it++)
+            for (auto b = it->bottoms.begin(); b != it->bottoms.end(); b++)
+                if (*b == blob)
+                    *b = sub.name;
+        layers.insert(layers.begin() + findProducer(blob) + 1, sub);
+        removed--;
+    }
+    return removed;
+}
+
+bool loadFolded(ncnn::Net& net, const string& param_file, const string& bin_file,
+                const float* mean, const float* norm, bool swap_rb)
+{
+    ModelGraph graph;
+    if (graph.load(param_file, bin_file) == 0)
+    {
+        graph.foldBatchNorm();
+        if (graph.foldInput("data", mean, norm, swap_rb) >= 0 && graph.loadInto(net) == 0)
+            return true;
+        net.clear();
+    }
+    net.load_param(param_file.c_str());
+    net.load_model(bin_file.c_str());
+    return false;
+}
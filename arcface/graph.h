@@ -0,0 +1,73 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <vector>
+#include <string>
+#include "net.h"
+
+using namespace std;
+
+// Editable copy of an ncnn param/bin pair. Models are parsed into this form,
+// rewritten by the optimization passes and handed to ncnn::Net, so the nets
+// never see the layers that were folded away.
+struct GraphLayer {
+    string type;
+    string name;
+    vector<string> bottoms;
+    vector<string> tops;
+    vector<pair<int, string> > params;
+    // weight blobs in load order; raw[i] marks data stored without a type flag
+    vector<ncnn::Mat> weights;
+    vector<bool> raw;
+
+    int getInt(int id, int def) const;
+    float getFloat(int id, float def) const;
+    void set(int id, int v);
+    void set(int id, float v);
+};
+
+// how save() stores the typed weight blobs; raw blobs are always fp32.
+// ncnn widens fp16 and table weights to fp32 when it loads them
+enum WeightFormat {
+    WEIGHT_FP32,
+    WEIGHT_FP16,
+    // ncnn 8-bit format, a 256 entry table per blob that ncnn expands on load
+    WEIGHT_TABLE,
+};
+
+class ModelGraph {
+public:
+    // return 0 if success
+    int load(const string& param_file, const string& bin_file);
+    int save(const string& param_file, const string& bin_file, WeightFormat format = WEIGHT_FP32) const;
+    // return 0 if success
+    int loadInto(ncnn::Net& net) const;
+
+    // merge every BatchNorm into the Convolution, ConvolutionDepthWise or
+    // InnerProduct that feeds it. returns the number of layers removed
+    int foldBatchNorm();
+
+    // Fold the input transform (x - mean) * norm, together with any scalar
+    // BinaryOp layers directly behind the input, into the convolutions that
+    // read the input. With swap_rb the convolutions also take the channels in
+    // the opposite order. The mean only folds exactly into unpadded
+    // convolutions; otherwise a single subtraction layer is kept in front.
+    // returns the number of layers removed, -1 if the input cannot be folded
+    int foldInput(const string& blob, const float* mean, const float* norm, bool swap_rb);
+
+    vector<GraphLayer> layers;
+
+private:
+    int findProducer(const string& blob) const;
+    vector<int> findConsumers(const string& blob) const;
+    string toParam() const;
+    void toBin(vector<unsigned char>& bin, WeightFormat format) const;
+};
+
+// Loads the model with batchnorm and the input transform folded in. Falls back
+// to the plain files when the graph cannot be rewritten, in which case the
+// caller still has to normalize (and swap) its input. returns true if folded
+bool loadFolded(ncnn::Net& net, const string& param_file, const string& bin_file,
+                const float* mean, const float* norm, bool swap_rb);
+
+#endif
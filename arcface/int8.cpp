@@ -0,0 +1,362 @@
+#include <cmath>
+#include <cstring>
+#include "arena.h"
+#include "int8.h"
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
+// output pixels per packed tile and output channels per block of the kernel
+#define TILE 8
+#define BLOCK 4
+
+DEFINE_LAYER_CREATOR(ConvolutionInt8)
+DEFINE_LAYER_CREATOR(ConvolutionDepthWiseInt8)
+
+ConvolutionInt8::ConvolutionInt8()
+{
+    one_blob_only = true;
+    support_inplace = false;
+}
+
+int ConvolutionInt8::load_param(const ncnn::ParamDict& pd)
+{
+    num_output = pd.get(0, 0);
+    kernel_w = pd.get(1, 0);
+    kernel_h = pd.get(11, kernel_w);
+    dilation_w = pd.get(2, 1);
+    dilation_h = pd.get(12, dilation_w);
+    stride_w = pd.get(3, 1);
+    stride_h = pd.get(13, stride_w);
+    pad_w = pd.get(4, 0);
+    pad_h = pd.get(14, pad_w);
+    bias_term = pd.get(5, 0);
+    weight_data_size = pd.get(6, 0);
+    input_scale = pd.get(8, 1.f);
+    return 0;
+}
+
+int ConvolutionInt8::load_model(const ncnn::ModelBin& mb)
+{
+    ncnn::Mat words = mb.load((weight_data_size + 3) / 4, 1);
+    ncnn::Mat weight_scales = mb.load(num_output, 1);
+    if (words.empty() || weight_scales.empty())
+        return -100;
+    if (bias_term)
+    {
+        bias_data = mb.load(num_output, 1);
+        if (bias_data.empty())
+            return -100;
+    }
+
+    // repack as (w[k], w[k + 1]) int16 pairs, rows padded to a whole block
+    const signed char* q = (const signed char*)words.data;
+    int maxk = weight_data_size / num_output;
+    int pairs = (maxk + 1) / 2;
+    int rows = (num_output + BLOCK - 1) / BLOCK * BLOCK;
+    weight_pairs.create(pairs * 2, rows, (size_t)2u);
+    memset(weight_pairs.data, 0, weight_pairs.total() * 2);
+    for (int o = 0; o < num_output; o++)
+    {
+        short* row = (short*)weight_pairs.data + o * pairs * 2;
+        for (int k = 0; k < maxk; k++)
+            row[k] = q[o * maxk + k];
+    }
+
+    dequant_scales.create(num_output);
+    for (int o = 0; o < num_output; o++)
+        dequant_scales[o] = 1.f / (input_scale * weight_scales[o]);
+    return 0;
+}
+
+// rounds half away from zero, as roundf does for the weights
+static inline short quantize(float v, float scale)
+{
+    int q = (int)roundf(v * scale);
+    return (short)(q > 127 ? 127 : q < -127 ? -127 : q);
+}
+
+#if __SSE2__
+// quantize() of four values. clamped before the conversion, which only
+// truncates, and moved a step away from zero where the fraction is a half
+// or more, so that both paths agree on the ties
+static inline __m128i quantize4(__m128 v, __m128 scale)
+{
+    v = _mm_max_ps(_mm_min_ps(_mm_mul_ps(v, scale), _mm_set1_ps(127.f)), _mm_set1_ps(-127.f));
+    __m128i q = _mm_cvttps_epi32(v);
+    __m128 frac = _mm_sub_ps(v, _mm_cvtepi32_ps(q));
+    // the masks are -1 where they hold
+    __m128i up = _mm_castps_si128(_mm_cmpge_ps(frac, _mm_set1_ps(0.5f)));
+    __m128i down = _mm_castps_si128(_mm_cmple_ps(frac, _mm_set1_ps(-0.5f)));
+    return _mm_add_epi32(_mm_sub_epi32(q, up), down);
+}
+#endif
+
+int ConvolutionInt8::forward(const ncnn::Mat& bottom_blob, ncnn::Mat& top_blob) const
+{
+    ncnn::Mat bordered = bottom_blob;
+    if (pad_w > 0 || pad_h > 0)
+    {
+        copy_make_border(bottom_blob, bordered, pad_h, pad_h, pad_w, pad_w, ncnn::BORDER_CONSTANT, 0.f);
+        if (bordered.empty())
+            return -100;
+    }
+
+    int w = bordered.w;
+    int h = bordered.h;
+    int outw = (w - (dilation_w * (kernel_w - 1) + 1)) / stride_w + 1;
+    int outh = (h - (dilation_h * (kernel_h - 1) + 1)) / stride_h + 1;
+    int size = outw * outh;
+    int maxk = weight_data_size / num_output;
+    int pairs = (maxk + 1) / 2;
+    int tiles = (size + TILE - 1) / TILE;
+
+    top_blob.create(outw, outh, num_output);
+    if (top_blob.empty())
+        return -100;
+
+    Arena& arena = frameArena();
+    ArenaScope scope(arena);
+
+    // input offset of every (channel, ky, kx) and of every output pixel
+    int* koff = arena.alloc<int>(pairs * 2);
+    int* poff = arena.alloc<int>(tiles * TILE);
+    for (int k = 0; k < maxk; k++)
+    {
+        int c = k / (kernel_w * kernel_h);
+        int ky = k / kernel_w % kernel_h;
+        int kx = k % kernel_w;
+        koff[k] = (int)(c * bordered.cstep) + ky * dilation_h * w + kx * dilation_w;
+    }
+    for (int p = 0; p < size; p++)
+        poff[p] = p / outw * stride_h * w + p % outw * stride_w;
+
+    // quantized im2col, tile by tile: the pairs of one pixel are adjacent so
+    // that a single multiply-add consumes two input channels
+    short* packed = arena.alloc<short>((size_t)tiles * pairs * TILE * 2);
+    const float* src = bordered;
+    bool pointwise = maxk == bordered.c && stride_w == 1 && stride_h == 1 && size == w * h;
+    #pragma omp parallel for
+    for (int t = 0; t < tiles; t++)
+    {
+        short* dst = packed + (size_t)t * pairs * TILE * 2;
+        int p0 = t * TILE;
+#if __SSE2__
+        if (pointwise && p0 + TILE <= size)
+        {
+            // channels are contiguous planes, quantize eight pixels of two channels at once
+            __m128 vscale = _mm_set1_ps(input_scale);
+            for (int kk = 0; kk < pairs; kk++)
+            {
+                __m128i q[2];
+                for (int i = 0; i < 2; i++)
+                {
+                    int k = kk * 2 + i;
+                    if (k >= maxk)
+                    {
+                        q[i] = _mm_setzero_si128();
+                        continue;
+                    }
+                    const float* ptr = src + koff[k] + p0;
+                    q[i] = _mm_packs_epi32(quantize4(_mm_loadu_ps(ptr), vscale), quantize4(_mm_loadu_ps(ptr + 4), vscale));
+                }
+                _mm_store_si128((__m128i*)dst, _mm_unpacklo_epi16(q[0], q[1]));
+                _mm_store_si128((__m128i*)(dst + 8), _mm_unpackhi_epi16(q[0], q[1]));
+                dst += TILE * 2;
+            }
+            continue;
+        }
+#endif
+        for (int kk = 0; kk < pairs; kk++)
+        {
+            for (int j = 0; j < TILE; j++)
+            {
+                int p = p0 + j;
+                for (int i = 0; i < 2; i++)
+                {
+                    int k = kk * 2 + i;
+                    *dst++ = p < size && k < maxk ? quantize(src[koff[k] + poff[p]], input_scale) : 0;
+                }
+            }
+        }
+    }
+
+    // one tile of packed input stays in cache while every output channel
+    // block runs over it
+    int blocks = weight_pairs.h / BLOCK;
+    #pragma omp parallel for
+    for (int t = 0; t < tiles; t++)
+    {
+        const int* tile = (const int*)packed + (size_t)t * pairs * TILE;
+        for (int b = 0; b < blocks; b++)
+        {
+            const int* wrows = (const int*)weight_pairs.data + b * BLOCK * pairs;
+            int sum[BLOCK][TILE];
+#if __SSE2__
+            // written out for BLOCK 4 so that the accumulators stay in registers
+            const int* w0 = wrows;
+            const int* w1 = wrows + pairs;
+            const int* w2 = wrows + pairs * 2;
+            const int* w3 = wrows + pairs * 3;
+            __m128i s00 = _mm_setzero_si128(), s01 = _mm_setzero_si128();
+            __m128i s10 = _mm_setzero_si128(), s11 = _mm_setzero_si128();
+            __m128i s20 = _mm_setzero_si128(), s21 = _mm_setzero_si128();
+            __m128i s30 = _mm_setzero_si128(), s31 = _mm_setzero_si128();
+            for (int kk = 0; kk < pairs; kk++)
+            {
+                __m128i x0 = _mm_load_si128((const __m128i*)(tile + kk * TILE));
+                __m128i x1 = _mm_load_si128((const __m128i*)(tile + kk * TILE + 4));
+                __m128i wv = _mm_set1_epi32(w0[kk]);
+                s00 = _mm_add_epi32(s00, _mm_madd_epi16(wv, x0));
+                s01 = _mm_add_epi32(s01, _mm_madd_epi16(wv, x1));
+                wv = _mm_set1_epi32(w1[kk]);
+                s10 = _mm_add_epi32(s10, _mm_madd_epi16(wv, x0));
+                s11 = _mm_add_epi32(s11, _mm_madd_epi16(wv, x1));
+                wv = _mm_set1_epi32(w2[kk]);
+                s20 = _mm_add_epi32(s20, _mm_madd_epi16(wv, x0));
+                s21 = _mm_add_epi32(s21, _mm_madd_epi16(wv, x1));
+                wv = _mm_set1_epi32(w3[kk]);
+                s30 = _mm_add_epi32(s30, _mm_madd_epi16(wv, x0));
+                s31 = _mm_add_epi32(s31, _mm_madd_epi16(wv, x1));
+            }
+            _mm_storeu_si128((__m128i*)sum[0], s00);
+            _mm_storeu_si128((__m128i*)(sum[0] + 4), s01);
+            _mm_storeu_si128((__m128i*)sum[1], s10);
+            _mm_storeu_si128((__m128i*)(sum[1] + 4), s11);
+            _mm_storeu_si128((__m128i*)sum[2], s20);
+            _mm_storeu_si128((__m128i*)(sum[2] + 4), s21);
+            _mm_storeu_si128((__m128i*)sum[3], s30);
+            _mm_storeu_si128((__m128i*)(sum[3] + 4), s31);
+#else
+            memset(sum, 0, sizeof(sum));
+            for (int kk = 0; kk < pairs; kk++)
+            {
+                const short* x = (const short*)(tile + kk * TILE);
+                for (int r = 0; r < BLOCK; r++)
+                {
+                    const short* wp = (const short*)(wrows + r * pairs + kk);
+                    for (int j = 0; j < TILE; j++)
+                        sum[r][j] += wp[0] * x[j * 2] + wp[1] * x[j * 2 + 1];
+                }
+            }
+#endif
+            for (int r = 0; r < BLOCK; r++)
+            {
+                int o = b * BLOCK + r;
+                if (o >= num_output)
+                    break;
+                float scale = dequant_scales[o];
+                float bias = bias_term ? bias_data[o] : 0.f;
+                float* out = top_blob.channel(o);
+                for (int j = 0; j < TILE && t * TILE + j < size; j++)
+                    out[t * TILE + j] = sum[r][j] * scale + bias;
+            }
+        }
+    }
+
+    return 0;
+}
+
+ConvolutionDepthWiseInt8::ConvolutionDepthWiseInt8()
+{
+    one_blob_only = true;
+    support_inplace = false;
+    depthwise = ncnn::create_layer("ConvolutionDepthWise");
+}
+
+ConvolutionDepthWiseInt8::~ConvolutionDepthWiseInt8()
+{
+    delete depthwise;
+}
+
+int ConvolutionDepthWiseInt8::load_param(const ncnn::ParamDict& pd)
+{
+    num_output = pd.get(0, 0);
+    bias_term = pd.get(5, 0);
+    weight_data_size = pd.get(6, 0);
+    return depthwise ? depthwise->load_param(pd) : -1;
+}
+
+int ConvolutionDepthWiseInt8::load_model(const ncnn::ModelBin& mb)
+{
+    ncnn::Mat words = mb.load((weight_data_size + 3) / 4, 1);
+    ncnn::Mat weight_scales = mb.load(num_output, 1);
+    if (words.empty() || weight_scales.empty())
+        return -100;
+
+    ncnn::Mat weights[2];
+    weights[0].create(weight_data_size);
+    const signed char* q = (const signed char*)words.data;
+    int maxk = weight_data_size / num_output;
+    for (int i = 0; i < weight_data_size; i++)
+        weights[0][i] = q[i] / weight_scales[i / maxk];
+    if (bias_term)
+    {
+        weights[1] = mb.load(num_output, 1);
+        if (weights[1].empty())
+            return -100;
+    }
+    return depthwise->load_model(ncnn::ModelBinFromMatArray(weights));
+}
+
+int ConvolutionDepthWiseInt8::forward(const ncnn::Mat& bottom_blob, ncnn::Mat& top_blob) const
+{
+    return depthwise->forward(bottom_blob, top_blob);
+}
+
+void registerInt8Layers(ncnn::Net& net)
+{
+    net.register_custom_layer("ConvolutionInt8", ConvolutionInt8_layer_creator);
+    net.register_custom_layer("ConvolutionDepthWiseInt8", ConvolutionDepthWiseInt8_layer_creator);
+}
+
+// int8 weights packed four to a word followed by one scale per output channel
+static void quantizeWeights(GraphLayer& layer)
+{
+    int num_output = layer.getInt(0, 0);
+    const ncnn::Mat& weight = layer.weights[0];
+    int maxk = weight.w / num_output;
+
+    ncnn::Mat words((weight.w + 3) / 4);
+    ncnn::Mat scales(num_output);
+    memset(words.data, 0, words.w * sizeof(float));
+    signed char* q = (signed char*)words.data;
+    for (int o = 0; o < num_output; o++)
+    {
+        const float* row = (const float*)weight.data + o * maxk;
+        float absmax = 0.f;
+        for (int k = 0; k < maxk; k++)
+            absmax = fmax(absmax, fabs(row[k]));
+        scales[o] = absmax > 0.f ? 127.f / absmax : 1.f;
+        for (int k = 0; k < maxk; k++)
+            q[o * maxk + k] = (signed char)roundf(row[k] * scales[o]);
+    }
+
+    vector<ncnn::Mat> weights;
+    weights.push_back(words);
+    weights.push_back(scales);
+    if (layer.getInt(5, 0))
+        weights.push_back(layer.weights[1]);
+    layer.weights = weights;
+    layer.raw.assign(weights.size(), true);
+}
+
+int quantizeConvolution(GraphLayer& layer, float input_scale)
+{
+    if (layer.type != "Convolution" || layer.weights.empty() || input_scale <= 0.f)
+        return -1;
+    quantizeWeights(layer);
+    layer.type = "ConvolutionInt8";
+    layer.set(8, input_scale);
+    return 0;
+}
+
+int quantizeDepthWise(GraphLayer& layer)
+{
+    if (layer.type != "ConvolutionDepthWise" || layer.weights.empty())
+        return -1;
+    quantizeWeights(layer);
+    layer.type = "ConvolutionDepthWiseInt8";
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef INT8_H
+#define INT8_H
+
+#include "net.h"
+#include "layer.h"
+#include "graph.h"
+
+// Convolution with int8 weights, one scale per output channel, and int8
+// activations quantized with a calibrated per layer scale. Outputs stay fp32,
+// so the layer drops in for a Convolution with the same parameters plus
+// 8=input_scale. The int8 weights travel through the model file as raw 4 byte
+// words, which the ModelBin of this ncnn passes through untouched.
+class ConvolutionInt8 : public ncnn::Layer {
+public:
+    ConvolutionInt8();
+
+    virtual int load_param(const ncnn::ParamDict& pd);
+    virtual int load_model(const ncnn::ModelBin& mb);
+    virtual int forward(const ncnn::Mat& bottom_blob, ncnn::Mat& top_blob) const;
+
+public:
+    int num_output;
+    int kernel_w;
+    int kernel_h;
+    int dilation_w;
+    int dilation_h;
+    int stride_w;
+    int stride_h;
+    int pad_w;
+    int pad_h;
+    int bias_term;
+    int weight_data_size;
+    float input_scale;
+
+    // int16 pairs of consecutive input channels, the layout the kernel reads
+    ncnn::Mat weight_pairs;
+    ncnn::Mat dequant_scales;
+    ncnn::Mat bias_data;
+};
+
+// ConvolutionDepthWise with the weights stored as int8 with per channel
+// scales. Depthwise layers carry little compute, so they are only quantized
+// for size: the weights are expanded on load and the stock layer runs them.
+class ConvolutionDepthWiseInt8 : public ncnn::Layer {
+public:
+    ConvolutionDepthWiseInt8();
+    virtual ~ConvolutionDepthWiseInt8();
+
+    virtual int load_param(const ncnn::ParamDict& pd);
+    virtual int load_model(const ncnn::ModelBin& mb);
+    virtual int forward(const ncnn::Mat& bottom_blob, ncnn::Mat& top_blob) const;
+
+public:
+    int num_output;
+    int bias_term;
+    int weight_data_size;
+
+    ncnn::Layer* depthwise;
+};
+
+ncnn::Layer* ConvolutionInt8_layer_creator();
+ncnn::Layer* ConvolutionDepthWiseInt8_layer_creator();
+
+// registers the int8 layers on the net, call before loading an int8 model
+void registerInt8Layers(ncnn::Net& net);
+
+// turns a Convolution into a ConvolutionInt8 with per channel weight scales.
+// input_scale maps the layer input to [-127, 127]. return 0 if success
+int quantizeConvolution(GraphLayer& layer, float input_scale);
+
+// turns a ConvolutionDepthWise into a ConvolutionDepthWiseInt8. return 0 if success
+int quantizeDepthWise(GraphLayer& layer);
+
+#endif
@@ -0,0 +1,280 @@
+#include <cstdio>
+#include <csetjmp>
+#include <algorithm>
+#include <jpeglib.h>
+#include "jpegimage.h"
+#include "arcface.h"
+#include "mtcnn.h"
+
+// libjpeg reports errors through a callback that must not return
+struct JpegError {
+    jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void onJpegError(j_common_ptr cinfo)
+{
+    longjmp(((JpegError*)cinfo->err)->jump, 1);
+}
+
+static void silent(j_common_ptr)
+{
+}
+
+bool JpegImage::open(const string& path)
+{
+    data.clear();
+    w = h = 0;
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size > 0)
+    {
+        data.resize(size);
+        if (fread(data.data(), 1, size, fp) != (size_t)size)
+            data.clear();
+    }
+    fclose(fp);
+    return readHeader();
+}
+
+bool JpegImage::open(const unsigned char* bytes, size_t size)
+{
+    data.assign(bytes, bytes + size);
+    w = h = 0;
+    return readHeader();
+}
+
+bool JpegImage::readHeader()
+{
+    if (data.empty())
+        return false;
+
+    jpeg_decompress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = onJpegError;
+    err.mgr.output_message = silent;
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        data.clear();
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data.data(), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+    w = cinfo.image_width;
+    h = cinfo.image_height;
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+ncnn::Mat JpegImage::decode(int denom) const
+{
+    if (data.empty())
+        return ncnn::Mat();
+
+    jpeg_decompress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = onJpegError;
+    err.mgr.output_message = silent;
+    // no destructors may be skipped by the jump, so the arena is rewound by hand
+    Arena& arena = frameArena();
+    Arena::Mark mark = arena.mark();
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        arena.rewind(mark);
+        return ncnn::Mat();
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data.data(), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_EXT_BGR;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+    jpeg_start_decompress(&cinfo);
+
+    int out_w = cinfo.output_width;
+    int out_h = cinfo.output_height;
+    unsigned char* pixels = arena.alloc<unsigned char>(out_w * out_h * 3);
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        unsigned char* row = pixels + cinfo.output_scanline * out_w * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    ncnn::Mat out = ncnn::Mat::from_pixels(pixels, ncnn::Mat::PIXEL_BGR, out_w, out_h);
+    arena.rewind(mark);
+    return out;
+}
+
+ncnn::Mat JpegImage::decode(int x0, int y0, int x1, int y1) const
+{
+    x0 = max(x0, 0);
+    y0 = max(y0, 0);
+    x1 = min(x1, w);
+    y1 = min(y1, h);
+    if (data.empty() || x1 <= x0 || y1 <= y0)
+        return ncnn::Mat();
+
+    jpeg_decompress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = onJpegError;
+    err.mgr.output_message = silent;
+    Arena& arena = frameArena();
+    Arena::Mark mark = arena.mark();
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        arena.rewind(mark);
+        return ncnn::Mat();
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data.data(), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_EXT_BGR;
+    jpeg_start_decompress(&cinfo);
+
+    // the crop starts on a DCT block boundary, left of x0
+    JDIMENSION crop_x = x0;
+    JDIMENSION crop_w = x1 - x0;
+    jpeg_crop_scanline(&cinfo, &crop_x, &crop_w);
+    if (y0 > 0)
+        jpeg_skip_scanlines(&cinfo, y0);
+
+    int out_w = x1 - x0;
+    int out_h = y1 - y0;
+    int skip = x0 - (int)crop_x;
+    unsigned char* row = arena.alloc<unsigned char>(crop_w * 3);
+    unsigned char* pixels = arena.alloc<unsigned char>(out_w * out_h * 3);
+    for (int y = 0; y < out_h; y++)
+    {
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        memcpy(pixels + y * out_w * 3, row + skip * 3, out_w * 3);
+    }
+    // the rows below the region are never decoded
+    jpeg_abort_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    ncnn::Mat out = ncnn::Mat::from_pixels(pixels, ncnn::Mat::PIXEL_BGR, out_w, out_h);
+    arena.rewind(mark);
+    return out;
+}
+
+int JpegImage::reduction(float minsize)
+{
+    int denom = 8;
+    while (denom > 1 && denom * 12 > minsize)
+        denom /= 2;
+    return denom;
+}
+
+void scaleFaces(vector<FaceInfo>& faces, int denom)
+{
+    for (auto it = faces.begin(); it != faces.end(); it++)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            it->x[i] *= denom;
+            it->y[i] *= denom;
+        }
+        for (int i = 0; i < 10; i++)
+            it->landmark[i] *= denom;
+        it->area *= denom * denom;
+    }
+}
+
+ncnn::Mat preprocess(const JpegImage& jpeg, FaceInfo info)
+{
+    // the aligned crop reaches a little beyond the box, keep half a box around it
+    int x0 = info.x[0], y0 = info.y[0], x1 = info.x[1], y1 = info.y[1];
+    for (int i = 0; i < 5; i++)
+    {
+        x0 = min(x0, info.landmark[2 * i]);
+        x1 = max(x1, info.landmark[2 * i]);
+        y0 = min(y0, info.landmark[2 * i + 1]);
+        y1 = max(y1, info.landmark[2 * i + 1]);
+    }
+    int margin = max(x1 - x0, y1 - y0) / 2;
+    x0 = max(0, x0 - margin);
+    y0 = max(0, y0 - margin);
+    x1 = min(jpeg.width(), x1 + margin);
+    y1 = min(jpeg.height(), y1 + margin);
+
+    ncnn::Mat region = jpeg.decode(x0, y0, x1, y1);
+    if (region.empty())
+        return region;
+    for (int i = 0; i < 5; i++)
+    {
+        info.landmark[2 * i] -= x0;
+        info.landmark[2 * i + 1] -= y0;
+    }
+    return preprocess(region, info);
+}
+
+bool writeJpeg(const string& path, const unsigned char* pixels, int w, int h, int quality)
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+    jpeg_compress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = onJpegError;
+    err.mgr.output_message = silent;
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_compress(&cinfo);
+        fclose(fp);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_EXT_BGR;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = (JSAMPROW)(pixels + (size_t)cinfo.next_scanline * w * 3);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return fclose(fp) == 0;
+}
+
+ncnn::Mat detectAligned(MtcnnDetector& detector, const JpegImage& jpeg, vector<FaceInfo>& faces)
+{
+    float minsize = detector.GetMinSize();
+    int denom = JpegImage::reduction(minsize);
+    ncnn::Mat img = jpeg.decode(denom);
+    faces.clear();
+    if (img.empty())
+        return ncnn::Mat();
+    detector.Detect(img, faces, minsize / denom);
+    scaleFaces(faces, denom);
+
+    ncnn::Mat crops;
+    if (faces.empty())
+        return crops;
+    crops.create(112, 112, 3 * (int)faces.size());
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        ncnn::Mat face = denom > 1 ? preprocess(jpeg, faces[i]) : preprocess(img, faces[i]);
+        if (face.empty())
+            return ncnn::Mat();
+        memcpy(crops.channel(3 * i), (const float*)face, face.cstep * 3 * sizeof(float));
+    }
+    return crops;
+}
@@ -0,0 +1,62 @@
+#ifndef JPEGIMAGE_H
+#define JPEGIMAGE_H
+
+#include <vector>
+#include <string>
+#include "net.h"
+#include "base.h"
+
+using namespace std;
+
+// A JPEG file kept compressed in memory and decoded on demand, either whole at
+// 1/2, 1/4 or 1/8 of its size through libjpeg's DCT scaling, or as a full
+// resolution region. Detection runs on a reduced decode, and only the pixels
+// around the faces are decoded at full resolution for alignment.
+class JpegImage {
+public:
+    // reads the file and its header. returns false if it is not a readable JPEG
+    bool open(const string& path);
+    // the same for a file already in memory, which is copied
+    bool open(const unsigned char* bytes, size_t size);
+
+    int width() const { return w; }
+    int height() const { return h; }
+
+    // BGR pixels as ncnn::Mat::from_pixels makes them, scaled by 1/denom with
+    // denom one of 1, 2, 4 or 8. empty on a decode error
+    ncnn::Mat decode(int denom = 1) const;
+    // full resolution BGR pixels of the columns [x0, x1) and rows [y0, y1),
+    // decoding only the rows and the DCT blocks that cover them
+    ncnn::Mat decode(int x0, int y0, int x1, int y1) const;
+
+    // largest of 1, 2, 4 and 8 that keeps faces of minsize at least 12 pixels,
+    // the PNet input size, so the first pyramid level needs no more pixels
+    static int reduction(float minsize);
+
+private:
+    vector<unsigned char> data;
+    int w = 0;
+    int h = 0;
+
+    bool readHeader();
+};
+
+// maps faces found on an image reduced by 1/denom back to full resolution
+void scaleFaces(vector<FaceInfo>& faces, int denom);
+
+// preprocess() of a face in full resolution coordinates, decoding only the
+// region around the face
+ncnn::Mat preprocess(const JpegImage& jpeg, FaceInfo info);
+
+// writes packed BGR pixels as a JPEG file. returns false on an error
+bool writeJpeg(const string& path, const unsigned char* pixels, int w, int h, int quality = 90);
+
+class MtcnnDetector;
+
+// Detect() on the decode reduced as far as the detector's minsize allows,
+// with the faces returned in full resolution coordinates, and their crops
+// aligned as by preprocessAll(). empty when there are no faces, or with
+// faces filled in when a region around one does not decode
+ncnn::Mat detectAligned(MtcnnDetector& detector, const JpegImage& jpeg, vector<FaceInfo>& faces);
+
+#endif
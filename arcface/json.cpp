@@ -0,0 +1,224 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "json.h"
+
+const JsonValue* JsonValue::find(const string& key) const
+{
+    if (type != OBJECT)
+        return 0;
+    for (auto it = members.begin(); it != members.end(); it++)
+        if (it->first == key)
+            return &it->second;
+    return 0;
+}
+
+double JsonValue::numberOr(const string& key, double def) const
+{
+    const JsonValue* v = find(key);
+    return v && v->type == NUMBER ? v->number : def;
+}
+
+namespace {
+
+struct Parser {
+    const string& text;
+    size_t pos;
+    string error;
+
+    Parser(const string& text) : text(text), pos(0) {}
+
+    bool fail(const char* what)
+    {
+        if (error.empty())
+            error = string(what) + " at offset " + to_string(pos);
+        return false;
+    }
+
+    void skipSpace()
+    {
+        while (pos < text.size() && text[pos] && strchr(" \t\r\n", text[pos]))
+            pos++;
+    }
+
+    bool literal(const char* word)
+    {
+        size_t n = strlen(word);
+        if (text.compare(pos, n, word) != 0)
+            return fail("unexpected token");
+        pos += n;
+        return true;
+    }
+
+    bool parseString(string& out)
+    {
+        // at the opening quote
+        pos++;
+        out.clear();
+        while (pos < text.size() && text[pos] != '"')
+        {
+            char c = text[pos++];
+            if (c == '\\')
+            {
+                if (pos >= text.size())
+                    break;
+                char e = text[pos++];
+                if (e == '"' || e == '\\' || e == '/')
+                    c = e;
+                else if (e == 'n')
+                    c = '\n';
+                else if (e == 't')
+                    c = '\t';
+                else if (e == 'r')
+                    c = '\r';
+                else
+                    return fail("unsupported escape");
+            }
+            out += c;
+        }
+        if (pos >= text.size())
+            return fail("unterminated string");
+        pos++;
+        return true;
+    }
+
+    bool parseValue(JsonValue& value, int depth)
+    {
+        if (depth > 64)
+            return fail("nested too deeply");
+        skipSpace();
+        if (pos >= text.size())
+            return fail("unexpected end");
+        char c = text[pos];
+        if (c == '{')
+        {
+            value.type = JsonValue::OBJECT;
+            pos++;
+            skipSpace();
+            if (pos < text.size() && text[pos] == '}')
+            {
+                pos++;
+                return true;
+            }
+            while (true)
+            {
+                skipSpace();
+                if (pos >= text.size() || text[pos] != '"')
+                    return fail("expected a member name");
+                value.members.push_back(make_pair(string(), JsonValue()));
+                if (!parseString(value.members.back().first))
+                    return false;
+                skipSpace();
+                if (pos >= text.size() || text[pos] != ':')
+                    return fail("expected ':'");
+                pos++;
+                if (!parseValue(value.members.back().second, depth + 1))
+                    return false;
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    pos++;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == '}')
+                {
+                    pos++;
+                    return true;
+                }
+                return fail("expected ',' or '}'");
+            }
+        }
+        if (c == '[')
+        {
+            value.type = JsonValue::ARRAY;
+            pos++;
+            skipSpace();
+            if (pos < text.size() && text[pos] == ']')
+            {
+                pos++;
+                return true;
+            }
+            while (true)
+            {
+                value.items.push_back(JsonValue());
+                if (!parseValue(value.items.back(), depth + 1))
+                    return false;
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    pos++;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == ']')
+                {
+                    pos++;
+                    return true;
+                }
+                return fail("expected ',' or ']'");
+            }
+        }
+        if (c == '"')
+        {
+            value.type = JsonValue::STRING;
+            return parseString(value.text);
+        }
+        if (c == 't' || c == 'f')
+        {
+            value.type = JsonValue::BOOL;
+            value.boolean = c == 't';
+            return literal(c == 't' ? "true" : "false");
+        }
+        if (c == 'n')
+        {
+            value.type = JsonValue::NUL;
+            return literal("null");
+        }
+        const char* start = text.c_str() + pos;
+        char* end = 0;
+        value.type = JsonValue::NUMBER;
+        value.number = strtod(start, &end);
+        if (end == start)
+            return fail("unexpected token");
+        pos += end - start;
+        return true;
+    }
+};
+
+}
+
+bool parseJson(const string& text, JsonValue& value, string& error)
+{
+    Parser parser(text);
+    value = JsonValue();
+    bool ok = parser.parseValue(value, 0);
+    if (ok)
+    {
+        parser.skipSpace();
+        if (parser.pos != text.size())
+            ok = parser.fail("trailing data");
+    }
+    error = parser.error;
+    return ok;
+}
+
+bool loadJson(const string& path, JsonValue& value, string& error)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+    string text;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        text.append(buf, n);
+    fclose(fp);
+    if (!parseJson(text, value, error))
+    {
+        error = path + ": " + error;
+        return false;
+    }
+    return true;
+}
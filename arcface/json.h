@@ -0,0 +1,36 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <vector>
+#include <string>
+
+using namespace std;
+
+// A small JSON reader for the files the tools write themselves, such as the
+// benchmark baseline. Numbers are doubles; string escapes other than \" \\ \/
+// and \n \t \r are refused.
+
+struct JsonValue {
+    enum Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+    Type type = NUL;
+    bool boolean = false;
+    double number = 0;
+    string text;
+    // elements of an array
+    vector<JsonValue> items;
+    // members of an object, in file order
+    vector<pair<string, JsonValue> > members;
+
+    // the member named key, 0 when there is none or this is not an object
+    const JsonValue* find(const string& key) const;
+    // the member as a number, def when it is missing or not a number
+    double numberOr(const string& key, double def) const;
+};
+
+// false with a message naming the offset of the error on malformed input
+bool parseJson(const string& text, JsonValue& value, string& error);
+
+// the whole file parsed, false when it cannot be read or parsed
+bool loadJson(const string& path, JsonValue& value, string& error);
+
+#endif
@@ -3,54 +3,83 @@
 #include <opencv2/opencv.hpp>
 #include "arcface.h"
 #include "mtcnn.h"
+#include "quality.h"
+#include "jpegimage.h"
+#include "cvinterop.h"
 using namespace cv;
 using namespace std;
 
-cv::Mat ncnn2cv(ncnn::Mat img)
+// A JPEG is decoded at the reduced size the detector's minsize allows and
+// again at full resolution only around the face; other formats are read whole
+// and used in place.
+struct Still {
+    JpegImage jpeg;
+    ncnn::Mat img;
+    int denom = 1;
+    Mat pixels;
+};
+
+static vector<FaceInfo> detectFile(MtcnnDetector& detector, const char* path, Still& still)
 {
-    unsigned char pix[img.h * img.w * 3];
-    img.to_pixels(pix, ncnn::Mat::PIXEL_BGR);
-    cv::Mat cv_img(img.h, img.w, CV_8UC3);
-    for (int i = 0; i < cv_img.rows; i++)
+    float minsize = detector.GetMinSize();
+    if (still.jpeg.open(path))
+    {
+        still.denom = JpegImage::reduction(minsize);
+        still.img = still.jpeg.decode(still.denom);
+    }
+    else
     {
-        for (int j = 0; j < cv_img.cols; j++)
-        {
-            cv_img.at<cv::Vec3b>(i,j)[0] = pix[3 * (i * cv_img.cols + j)];
-            cv_img.at<cv::Vec3b>(i,j)[1] = pix[3 * (i * cv_img.cols + j) + 1];
-            cv_img.at<cv::Vec3b>(i,j)[2] = pix[3 * (i * cv_img.cols + j) + 2];
-        }
+        still.pixels = imread(path);
+        return detector.Detect(cv2view(still.pixels));
     }
-    return cv_img;
+    vector<FaceInfo> faces;
+    detector.Detect(still.img, faces, minsize / still.denom);
+    scaleFaces(faces, still.denom);
+    return faces;
+}
+
+static ncnn::Mat alignFace(const Still& still, const FaceInfo& face)
+{
+    if (!still.pixels.empty())
+        return preprocess(cv2view(still.pixels), face);
+    if (still.denom > 1)
+        return preprocess(still.jpeg, face);
+    return preprocess(still.img, face);
 }
 
 int main(int argc, char* argv[])
 {
-    Mat img1;
-    Mat img2;
+    const char* path1 = "../image/gyy1.jpeg";
+    const char* path2 = "../image/gyy2.jpeg";
     if (argc == 3)
     {
-        img1 = imread(argv[1]);
-        img2 = imread(argv[2]);
+        path1 = argv[1];
+        path2 = argv[2];
     }
-    else{
-        img1 = imread("../image/gyy1.jpeg");
-        img2 = imread("../image/gyy2.jpeg");
-    }
-    ncnn::Mat ncnn_img1 = ncnn::Mat::from_pixels(img1.data, ncnn::Mat::PIXEL_BGR, img1.cols, img1.rows);
-    ncnn::Mat ncnn_img2 = ncnn::Mat::from_pixels(img2.data, ncnn::Mat::PIXEL_BGR, img2.cols, img2.rows);
 
     MtcnnDetector detector("../models");
+    Still still1, still2;
 
     double start = (double)getTickCount();
-    vector<FaceInfo> results1 = detector.Detect(ncnn_img1);
+    vector<FaceInfo> results1 = detectFile(detector, path1, still1);
     cout << "Detection Time: " << (getTickCount() - start) / getTickFrequency() << "s" << std::endl;
 
     start = (double)getTickCount();
-    vector<FaceInfo> results2 = detector.Detect(ncnn_img2);
+    vector<FaceInfo> results2 = detectFile(detector, path2, still2);
     cout << "Detection Time: " << (getTickCount() - start) / getTickFrequency() << "s" << std::endl;
 
-    ncnn::Mat det1 = preprocess(ncnn_img1, results1[0]);
-    ncnn::Mat det2 = preprocess(ncnn_img2, results2[0]);
+    QualityGate gate;
+    FaceQuality quality1, quality2;
+    bool usable1 = gate.Check(results1[0], quality1);
+    bool usable2 = gate.Check(results2[0], quality2);
+
+    ncnn::Mat det1 = alignFace(still1, results1[0]);
+    ncnn::Mat det2 = alignFace(still2, results2[0]);
+    usable1 = gate.CheckCrop(det1, quality1) && usable1;
+    usable2 = gate.CheckCrop(det2, quality2) && usable2;
+    cout << "Quality: " << quality1.total << " " << quality2.total << std::endl;
+    if (!usable1 || !usable2)
+        cout << "a face is below the quality threshold of " << gate.threshold << ", the similarity is unreliable" << std::endl;
     
     //for (auto it = results1.begin(); it != results1.end(); it++)
     //{
@@ -1,5 +1,26 @@
+#include "benchmark.h"
 #include "mtcnn.h"
 
+static bool expired(double deadline)
+{
+    return deadline > 0 && ncnn::get_current_time() > deadline;
+}
+
+// candidate lists of one Detect() call. they belong to the calling thread,
+// like the frame arena, so their capacity carries over to its next frame
+struct DetectScratch {
+    // candidates of every pnet pyramid level
+    vector<vector<FaceInfo> > levels;
+    vector<FaceInfo> pnet;
+    vector<FaceInfo> rnet;
+};
+
+static DetectScratch& detectScratch()
+{
+    static thread_local DetectScratch scratch;
+    return scratch;
+}
+
 MtcnnDetector::MtcnnDetector(string model_folder)
 {
     vector<string> param_files = {
@@ -14,14 +35,26 @@ MtcnnDetector::MtcnnDetector(string model_folder)
         model_folder + "/det3.bin",
         model_folder + "/det4.bin"
     };
-    this->Pnet.load_param(param_files[0].c_str());
-    this->Pnet.load_model(bin_files[0].c_str());
-    this->Rnet.load_param(param_files[1].c_str());
-    this->Rnet.load_model(bin_files[1].c_str());
-    this->Onet.load_param(param_files[2].c_str());
-    this->Onet.load_model(bin_files[2].c_str());
-    this->Lnet.load_param(param_files[3].c_str());
-    this->Lnet.load_model(bin_files[3].c_str());
+    // the mean/norm of the crops is folded into the first convolutions
+    this->folded[0] = Pnet.load(param_files[0], bin_files[0], mean_vals, norm_vals, false);
+    this->folded[1] = Rnet.load(param_files[1], bin_files[1], mean_vals, norm_vals, false);
+    this->folded[2] = Onet.load(param_files[2], bin_files[2], mean_vals, norm_vals, false);
+    this->folded[3] = Lnet.load(param_files[3], bin_files[3], mean_vals, norm_vals, false);
+
+    pnet_data = Pnet.resolve("data");
+    pnet_prob = Pnet.resolve("prob1");
+    pnet_bbox = Pnet.resolve("conv4_2");
+    rnet_data = Rnet.resolve("data");
+    rnet_prob = Rnet.resolve("prob1");
+    rnet_bbox = Rnet.resolve("conv5_2");
+    onet_data = Onet.resolve("data");
+    onet_prob = Onet.resolve("prob1");
+    onet_bbox = Onet.resolve("conv6_2");
+    onet_points = Onet.resolve("conv6_3");
+    lnet_data = Lnet.resolve("data");
+    const char* lnet_outputs[5] = {"fc5_1", "fc5_2", "fc5_3", "fc5_4", "fc5_5"};
+    for (int i = 0; i < 5; i++)
+        lnet_points[i] = Lnet.resolve(lnet_outputs[i]);
 }
 
 MtcnnDetector::~MtcnnDetector()
@@ -34,202 +67,356 @@ MtcnnDetector::~MtcnnDetector()
 
 vector<FaceInfo> MtcnnDetector::Detect(ncnn::Mat img)
 {
+    vector<FaceInfo> faces;
+    Detect(img, faces);
+    return faces;
+}
+
+void MtcnnDetector::Detect(ncnn::Mat img, vector<FaceInfo> &faces, DetectStats* stats)
+{
+    Detect(img, faces, minsize, stats);
+}
+
+void MtcnnDetector::Detect(ncnn::Mat img, vector<FaceInfo> &faces, float minsize, DetectStats* stats)
+{
+    ArenaScope scratch(frameArena());
+    Detect(toView(img, frameArena()), faces, minsize, stats);
+}
+
+vector<FaceInfo> MtcnnDetector::Detect(const ImageView& img)
+{
+    vector<FaceInfo> faces;
+    Detect(img, faces);
+    return faces;
+}
+
+void MtcnnDetector::Detect(const ImageView& img, vector<FaceInfo> &faces, DetectStats* stats)
+{
+    Detect(img, faces, minsize, stats);
+}
+
+void MtcnnDetector::Detect(const ImageView& img, vector<FaceInfo> &faces, float minsize, DetectStats* stats)
+{
+    if (!img.supported())
+    {
+        faces.clear();
+        if (stats)
+            *stats = DetectStats();
+        return;
+    }
     int img_w = img.w;
     int img_h = img.h;
 
-    vector<FaceInfo> pnet_results = Pnet_Detect(img);
+    ArenaScope frame(frameArena());
+    double deadline = time_budget > 0 ? ncnn::get_current_time() + time_budget : 0;
+    vector<FaceInfo>& pnet_results = detectScratch().pnet;
+    vector<FaceInfo>& rnet_results = detectScratch().rnet;
+
+    // doNms leaves the candidates sorted by score, so the caps keep the best ones
+    double start = ncnn::get_current_time();
+    DetectStats local;
+    if (!stats)
+        stats = &local;
+    Pnet_Detect(img, minsize, pnet_results, deadline);
     doNms(pnet_results, 0.7, "union");
     refine(pnet_results, img_h, img_w, true);
+    if (max_rnet_candidates > 0 && (int)pnet_results.size() > max_rnet_candidates)
+        pnet_results.resize(max_rnet_candidates);
+    double end = ncnn::get_current_time();
+    stats->pnet = pnet_results.size();
+    stats->pnet_ms = end - start;
 
-    vector<FaceInfo> rnet_results = Rnet_Detect(img, pnet_results);
+    start = end;
+    Rnet_Detect(img, pnet_results, rnet_results, deadline);
     doNms(rnet_results, 0.7, "union");
     refine(rnet_results, img_h, img_w, true);
+    if (max_onet_candidates > 0 && (int)rnet_results.size() > max_onet_candidates)
+        rnet_results.resize(max_onet_candidates);
+    end = ncnn::get_current_time();
+    stats->rnet = rnet_results.size();
+    stats->rnet_ms = end - start;
 
-    vector<FaceInfo> onet_results = Onet_Detect(img, rnet_results);
-    refine(onet_results, img_h, img_w, false);
-    doNms(onet_results, 0.7, "min");
+    start = end;
+    Onet_Detect(img, rnet_results, faces, deadline);
+    refine(faces, img_h, img_w, false);
+    doNms(faces, 0.7, "min");
+    end = ncnn::get_current_time();
+    stats->onet = faces.size();
+    stats->onet_ms = end - start;
 
-    Lnet_Detect(img, onet_results);
+    start = end;
+    if (!expired(deadline))
+        Lnet_Detect(img, faces);
+    stats->lnet_ms = ncnn::get_current_time() - start;
+}
 
-    return onet_results;
+void MtcnnDetector::SetCandidateLimits(int rnet, int onet)
+{
+    max_rnet_candidates = rnet;
+    max_onet_candidates = onet;
 }
 
-vector<FaceInfo> MtcnnDetector::Pnet_Detect(ncnn::Mat img)
+void MtcnnDetector::SetTimeBudget(double ms)
 {
-    vector<FaceInfo> results;
-    int img_w = img.w;
-    int img_h = img.h;
-    float minl = img_w < img_h ? img_w : img_h;
+    time_budget = ms;
+}
+
+void MtcnnDetector::SetMinSize(float minsize)
+{
+    this->minsize = minsize;
+}
+
+float MtcnnDetector::GetMinSize() const
+{
+    return minsize;
+}
+
+void MtcnnDetector::CalibrateThreads(int width, int height)
+{
+    pnet_threads.clear();
+    float minl = min(width, height);
     double scale = 12.0 / this->minsize;
     minl *= scale;
-    vector<double> scales;
     while (minl > 12)
     {
-        scales.push_back(scale);
+        pnet_threads.calibrate(Pnet, pnet_data, (int)ceil(width * scale), (int)ceil(height * scale), 3);
         minl *= this->factor;
         scale *= this->factor;
     }
-    for (auto it = scales.begin(); it != scales.end(); it++)
-    {
-        scale = (double)(*it);
-        int hs = (int) ceil(img_h * scale);
-        int ws = (int) ceil(img_w * scale);
-        ncnn::Mat in = resize(img, ws, hs);
-        in.substract_mean_normalize(this->mean_vals, this->norm_vals);
-        ncnn::Extractor ex = Pnet.create_extractor();
-        ex.set_light_mode(true);
-        ex.input("data", in);
-        ncnn::Mat score;
-        ncnn::Mat location;
-        ex.extract("prob1", score);
-        ex.extract("conv4_2", location);
-        vector<FaceInfo> bboxs = generateBbox(score, location, *it, this->threshold[0]);
-        doNms(bboxs, 0.5, "union");
-        results.insert(results.end(), bboxs.begin(), bboxs.end());
-    }
-    return results;
+    // one box at a time, these rarely gain from more than one thread. when
+    // one thread wins, Detect runs the boxes side by side instead
+    ThreadTable table;
+    rnet_threads = table.calibrate(Rnet, rnet_data, 24, 24, 3);
+    onet_threads = table.calibrate(Onet, onet_data, 48, 48, 3);
+    lnet_threads = table.calibrate(Lnet, lnet_data, 24, 24, 15);
 }
 
-vector<FaceInfo> MtcnnDetector::Rnet_Detect(ncnn::Mat img, vector<FaceInfo> bboxs)
+void MtcnnDetector::Pnet_Level(const ImageView& img, int level, double scale, int threads,
+                               vector<FaceInfo> &results, double deadline)
 {
-    vector<FaceInfo> results;
+    results.clear();
+    if (expired(deadline))
+        return;
+    Arena& arena = frameArena();
+    ArenaScope scope(arena);
+    int hs = (int) ceil(img.h * scale);
+    int ws = (int) ceil(img.w * scale);
+    ncnn::Mat in = cropResize(img, 0, 0, img.w, img.h, ws, hs, &arena,
+                              folded[0] ? 0 : mean_vals, folded[0] ? 0 : norm_vals);
+    // one workspace per pyramid level, so that each keeps its shapes
+    Workspace& workspace = Pnet.threadWorkspace(level);
+    workspace.set_num_threads(threads);
+    workspace.input(pnet_data, in);
+    Pnet.forward(workspace);
+    ncnn::Mat score = workspace.extract(pnet_prob);
+    ncnn::Mat location = workspace.extract(pnet_bbox);
+    generateBbox(score, location, scale, this->threshold[0], results);
+    doNms(results, 0.5, "union");
+}
 
+void MtcnnDetector::Pnet_Detect(const ImageView& img, float minsize, vector<FaceInfo> &results, double deadline)
+{
+    results.clear();
     int img_w = img.w;
     int img_h = img.h;
+    float minl = img_w < img_h ? img_w : img_h;
+    double scale = 12.0 / minsize;
+    minl *= scale;
+    int levels = 0;
+    for (float l = minl; l > 12; l *= this->factor)
+        levels++;
+    Arena& arena = frameArena();
+    double* scales = arena.alloc<double>(levels);
+    int* threads = arena.alloc<int>(levels);
+    for (int i = 0; i < levels; i++)
+    {
+        scales[i] = scale;
+        threads[i] = pnet_threads.lookup((int)ceil(img_w * scale) * (int)ceil(img_h * scale));
+        scale *= this->factor;
+    }
+    vector<vector<FaceInfo> >& level_results = detectScratch().levels;
+    if ((int)level_results.size() < levels)
+        level_results.resize(levels);
 
-    for (auto it = bboxs.begin(); it != bboxs.end(); it++)
+    // levels that gain from a team of their own, or were not calibrated, run
+    // one after another. those calibrated to one thread run side by side
+    for (int i = 0; i < levels; i++)
+        if (threads[i] != 1)
+            Pnet_Level(img, i, scales[i], threads[i], level_results[i], deadline);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < levels; i++)
+        if (threads[i] == 1)
+            Pnet_Level(img, i, scales[i], 1, level_results[i], deadline);
+    for (int i = 0; i < levels; i++)
+        results.insert(results.end(), level_results[i].begin(), level_results[i].end());
+}
+
+void MtcnnDetector::Rnet_Detect(const ImageView& img, vector<FaceInfo> &bboxs, vector<FaceInfo> &results, double deadline)
+{
+    results.clear();
+    int n = (int)bboxs.size();
+    if (n == 0)
+        return;
+
+    // a box per thread unless calibration gave a single box a team
+    bool per_box = rnet_threads <= 1;
+    ArenaScope frame(frameArena());
+    char* passed = frameArena().alloc<char>(n);
+    memset(passed, 0, n);
+    #pragma omp parallel if (per_box)
     {
-        ncnn::Mat img_t;
-        copy_cut_border(img, img_t, it->y[0], img_h - it->y[1], it->x[0], img_w - it->x[1]);
-        ncnn::Mat in = resize(img_t, 24, 24);
-        in.substract_mean_normalize(this->mean_vals, this->norm_vals);
-        ncnn::Extractor ex = Rnet.create_extractor();
-        ex.set_light_mode(true);
-        ex.input("data", in);
-        ncnn::Mat score, bbox;
-        ex.extract("prob1", score);
-        ex.extract("conv5_2", bbox);
-        if ((float)score[1] > threshold[1])
+        Arena& arena = frameArena();
+        Workspace& ws = Rnet.threadWorkspace();
+        ws.set_num_threads(per_box ? 1 : rnet_threads);
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < n; i++)
         {
-            for (int c = 0; c < 4; c++)
+            FaceInfo& box = bboxs[i];
+            if (expired(deadline))
+                continue;
+            if (box.x[1] <= box.x[0] || box.y[1] <= box.y[0])
+                continue;
+            ArenaScope scope(arena);
+            ncnn::Mat in = cropResize(img, box.x[0], box.y[0], box.x[1], box.y[1], 24, 24, &arena,
+                                      folded[1] ? 0 : mean_vals, folded[1] ? 0 : norm_vals);
+            ws.input(rnet_data, in);
+            Rnet.forward(ws);
+            const ncnn::Mat& score = ws.extract(rnet_prob);
+            const ncnn::Mat& bbox = ws.extract(rnet_bbox);
+            if ((float)score[1] > threshold[1])
             {
-                it->regreCoord[c] = (float)bbox[c];
+                for (int c = 0; c < 4; c++)
+                {
+                    box.regreCoord[c] = (float)bbox[c];
+                }
+                box.score = (float)score[1];
+                passed[i] = 1;
             }
-            it->score = (float)score[1];
-            results.push_back(*it);
         }
     }
-    return results;
+    for (int i = 0; i < n; i++)
+        if (passed[i])
+            results.push_back(bboxs[i]);
 }
 
-vector<FaceInfo> MtcnnDetector::Onet_Detect(ncnn::Mat img, vector<FaceInfo> bboxs)
+void MtcnnDetector::Onet_Detect(const ImageView& img, vector<FaceInfo> &bboxs, vector<FaceInfo> &results, double deadline)
 {
-    vector<FaceInfo> results;
-
-    int img_w = img.w;
-    int img_h = img.h;
+    results.clear();
+    int n = (int)bboxs.size();
+    if (n == 0)
+        return;
 
-    for (auto it = bboxs.begin(); it != bboxs.end(); it++)
+    bool per_box = onet_threads <= 1;
+    ArenaScope frame(frameArena());
+    char* passed = frameArena().alloc<char>(n);
+    memset(passed, 0, n);
+    #pragma omp parallel if (per_box)
     {
-        ncnn::Mat img_t;
-        copy_cut_border(img, img_t, it->y[0], img_h - it->y[1], it->x[0], img_w - it->x[1]);
-        ncnn::Mat in = resize(img_t, 48, 48);
-        in.substract_mean_normalize(this->mean_vals, this->norm_vals);
-        ncnn::Extractor ex = Onet.create_extractor();
-        ex.set_light_mode(true);
-        ex.input("data", in);
-        ncnn::Mat score, bbox, point;
-        ex.extract("prob1", score);
-        ex.extract("conv6_2", bbox);
-        ex.extract("conv6_3", point);
-        if ((float)score[1] > threshold[2])
+        Arena& arena = frameArena();
+        Workspace& ws = Onet.threadWorkspace();
+        ws.set_num_threads(per_box ? 1 : onet_threads);
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < n; i++)
         {
-            for (int c = 0; c < 4; c++)
+            FaceInfo& box = bboxs[i];
+            if (expired(deadline))
+                continue;
+            if (box.x[1] <= box.x[0] || box.y[1] <= box.y[0])
+                continue;
+            ArenaScope scope(arena);
+            ncnn::Mat in = cropResize(img, box.x[0], box.y[0], box.x[1], box.y[1], 48, 48, &arena,
+                                      folded[2] ? 0 : mean_vals, folded[2] ? 0 : norm_vals);
+            ws.input(onet_data, in);
+            Onet.forward(ws);
+            const ncnn::Mat& score = ws.extract(onet_prob);
+            const ncnn::Mat& bbox = ws.extract(onet_bbox);
+            const ncnn::Mat& point = ws.extract(onet_points);
+            if ((float)score[1] > threshold[2])
             {
-                it->regreCoord[c] = (float)bbox[c];
-            }
-            for (int p = 0; p < 5; p++)
-            {
-                it->landmark[2 * p] =  it->x[0] + (it->x[1] - it->x[0]) * point[p];
-                it->landmark[2 * p + 1] = it->y[0] + (it->y[1] - it->y[0]) * point[p + 5];
+                for (int c = 0; c < 4; c++)
+                {
+                    box.regreCoord[c] = (float)bbox[c];
+                }
+                for (int p = 0; p < 5; p++)
+                {
+                    box.landmark[2 * p] =  box.x[0] + (box.x[1] - box.x[0]) * point[p];
+                    box.landmark[2 * p + 1] = box.y[0] + (box.y[1] - box.y[0]) * point[p + 5];
+                }
+                box.score = (float)score[1];
+                passed[i] = 1;
             }
-            it->score = (float)score[1];
-            results.push_back(*it);
         }
     }
-    return results;
+    for (int i = 0; i < n; i++)
+        if (passed[i])
+            results.push_back(bboxs[i]);
 }
 
-void MtcnnDetector::Lnet_Detect(ncnn::Mat img, vector<FaceInfo> &bboxes)
+void MtcnnDetector::Lnet_Detect(const ImageView& img, vector<FaceInfo> &bboxes)
 {
-    int img_w = img.w;
-    int img_h = img.h;
+    int n = (int)bboxes.size();
+    if (n == 0)
+        return;
+    Arena& arena = frameArena();
+    ArenaScope scope(arena);
 
-    for (auto it = bboxes.begin(); it != bboxes.end(); it++)
+    // the five landmark patches of every face, sampled straight from the image
+    // into the 15 channel inputs, which lie back to back
+    int* half = arena.alloc<int>(n);
+    ncnn::Mat patches = arena.newMat(24, 24, 15 * n);
+    for (int i = 0; i < n; i++)
     {
-        int w = it->x[1] - it->x[0] + 1;
-        int h = it->y[1] - it->y[0] + 1;
+        const FaceInfo& face = bboxes[i];
+        int w = face.x[1] - face.x[0] + 1;
+        int h = face.y[1] - face.y[0] + 1;
         int m = w > h ? w : h;
         m = (int)round(m * 0.25);
         if (m % 2 == 1) m++;
         m /= 2;
+        half[i] = m;
 
-        ncnn::Mat in(24, 24, 15);
-
-        for (int i = 0; i < 5; i++)
+        for (int p = 0; p < 5; p++)
         {
-            int px = it->landmark[2 * i];
-            int py = it->landmark[2 * i + 1];
-            ncnn::Mat cut;
-            copy_cut_border(img, cut, py - m, img_h - py - m, px - m, img_w - px - m);
-            ncnn::Mat resized = resize(cut, 24, 24);
-            resized.substract_mean_normalize(this->mean_vals, this->norm_vals);
-            for (int j = 0; j < 3; j++)
-                memcpy(in.channel(3 * i + j), resized.channel(j), 24 * 24 * sizeof(float));
+            int px = face.landmark[2 * p];
+            int py = face.landmark[2 * p + 1];
+            ncnn::Mat patch(24, 24, 3, (void*)(float*)patches.channel(15 * i + 3 * p));
+            cropResize(img, px - m, py - m, px + m, py + m, patch,
+                       folded[3] ? 0 : mean_vals, folded[3] ? 0 : norm_vals);
         }
+    }
 
-        ncnn::Extractor ex = Lnet.create_extractor();
-        ex.set_light_mode(true);
-        ex.input("data", in);
-        ncnn::Mat out1, out2, out3, out4, out5;
-
-        ex.extract("fc5_1", out1);
-        ex.extract("fc5_2", out2);
-        ex.extract("fc5_3", out3);
-        ex.extract("fc5_4", out4);
-        ex.extract("fc5_5", out5);
-
-        if (abs(out1[0] - 0.5) > 0.35) out1[0] = 0.5f;
-        if (abs(out1[1] - 0.5) > 0.35) out1[1] = 0.5f;
-        if (abs(out2[0] - 0.5) > 0.35) out2[0] = 0.5f;
-        if (abs(out2[1] - 0.5) > 0.35) out2[1] = 0.5f;
-        if (abs(out3[0] - 0.5) > 0.35) out3[0] = 0.5f;
-        if (abs(out3[1] - 0.5) > 0.35) out3[1] = 0.5f;
-        if (abs(out4[0] - 0.5) > 0.35) out4[0] = 0.5f;
-        if (abs(out4[1] - 0.5) > 0.35) out4[1] = 0.5f;
-        if (abs(out5[0] - 0.5) > 0.35) out5[0] = 0.5f;
-        if (abs(out5[1] - 0.5) > 0.35) out5[1] = 0.5f;
-
-        it->landmark[0] += (int)round((out1[0] - 0.5) * m * 2);
-        it->landmark[1] += (int)round((out1[1] - 0.5) * m * 2);
-        it->landmark[2] += (int)round((out2[0] - 0.5) * m * 2);
-        it->landmark[3] += (int)round((out2[1] - 0.5) * m * 2);
-        it->landmark[4] += (int)round((out3[0] - 0.5) * m * 2);
-        it->landmark[5] += (int)round((out3[1] - 0.5) * m * 2);
-        it->landmark[6] += (int)round((out4[0] - 0.5) * m * 2);
-        it->landmark[7] += (int)round((out4[1] - 0.5) * m * 2);
-        it->landmark[8] += (int)round((out5[0] - 0.5) * m * 2);
-        it->landmark[9] += (int)round((out5[1] - 0.5) * m * 2);
+    bool per_box = lnet_threads <= 1;
+    #pragma omp parallel if (per_box)
+    {
+        Workspace& ws = Lnet.threadWorkspace();
+        ws.set_num_threads(per_box ? 1 : lnet_threads);
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < n; i++)
+        {
+            ncnn::Mat in(24, 24, 15, (void*)(float*)patches.channel(15 * i));
+            ws.input(lnet_data, in);
+            Lnet.forward(ws);
+            for (int p = 0; p < 5; p++)
+            {
+                // offsets within the patch, ignored when implausibly large
+                const ncnn::Mat& out = ws.extract(lnet_points[p]);
+                for (int k = 0; k < 2; k++)
+                {
+                    float offset = out[k];
+                    if (abs(offset - 0.5) > 0.35) offset = 0.5f;
+                    bboxes[i].landmark[2 * p + k] += (int)round((offset - 0.5) * half[i] * 2);
+                }
+            }
+        }
     }
 }
 
-vector<FaceInfo> MtcnnDetector::generateBbox(ncnn::Mat score, ncnn::Mat loc, float scale, float thresh)
+void MtcnnDetector::generateBbox(ncnn::Mat score, ncnn::Mat loc, float scale, float thresh, vector<FaceInfo> &results)
 {
     int stride = 2;
     int cellsize = 12;
     float *p = score.channel(1);
     float inv_scale = 1.0f / scale;
-    vector<FaceInfo> results;
     for (int row = 0; row < score.h; row++)
     {
         for (int col = 0; col < score.w; col++)
@@ -251,7 +438,6 @@ vector<FaceInfo> MtcnnDetector::generateBbox(ncnn::Mat score, ncnn::Mat loc, flo
             p++;        
         }
     }
-    return results;
 }
 
 bool cmpScore(FaceInfo x, FaceInfo y)
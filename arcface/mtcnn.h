@@ -8,31 +8,85 @@
 #include <algorithm>
 #include "net.h"
 #include "base.h"
+#include "network.h"
 
 using namespace std;
 
+// what one Detect() call did: the candidates each stage passed on, after
+// nms and the candidate limits, and the time spent in each stage
+struct DetectStats {
+    int pnet = 0;
+    int rnet = 0;
+    int onet = 0;
+    double pnet_ms = 0;
+    double rnet_ms = 0;
+    double onet_ms = 0;
+    double lnet_ms = 0;
+};
+
+// Detect may run on several threads at once on one detector, each thread
+// forwards through workspaces of its own. The setters and CalibrateThreads
+// change the configuration and must not overlap a Detect.
 class MtcnnDetector {
 public:
+    // throws runtime_error when a model lacks one of the blobs used below
     MtcnnDetector(string model_folder = ".");
     ~MtcnnDetector();
     vector<FaceInfo> Detect(ncnn::Mat img);
+    // reuses the capacity of faces, all scratch memory comes from the frame arena.
+    // stats, when given, receives the candidate counts and stage times
+    void Detect(ncnn::Mat img, vector<FaceInfo> &faces, DetectStats* stats = 0);
+    // reads the pixels in place; only the network inputs are converted to float
+    vector<FaceInfo> Detect(const ImageView& img);
+    void Detect(const ImageView& img, vector<FaceInfo> &faces, DetectStats* stats = 0);
+    // searches for faces of at least minsize pixels instead of the configured
+    // size, e.g. on a reduced decode, without touching the detector
+    void Detect(ncnn::Mat img, vector<FaceInfo> &faces, float minsize, DetectStats* stats = 0);
+    void Detect(const ImageView& img, vector<FaceInfo> &faces, float minsize, DetectStats* stats = 0);
+    void generateBbox(ncnn::Mat score, ncnn::Mat loc, float scale, float thresh, vector<FaceInfo> &results);
+    void doNms(vector<FaceInfo> &bboxs, float nms_thresh, string mode);
+    void refine(vector<FaceInfo> &bboxs, int height, int width, bool flag = false);
+    // keep only the best scoring candidates handed to rnet and onet, 0 = no limit
+    void SetCandidateLimits(int rnet, int onet);
+    // once the budget of a call is spent the remaining candidates are dropped
+    // and the faces confirmed so far are returned, 0 = no budget
+    void SetTimeBudget(double ms);
+    // smallest face side in pixels that is searched for
+    void SetMinSize(float minsize);
+    float GetMinSize() const;
+    // times each network on the inputs it gets for images of this size, every
+    // pyramid level separately, and keeps the fastest thread count for each
+    void CalibrateThreads(int width, int height);
 private:
     float minsize = 20;
     float threshold[3] = {0.6f, 0.7f, 0.8f};
     float factor = 0.709f;
+    int max_rnet_candidates = 0;
+    int max_onet_candidates = 0;
+    double time_budget = 0;
     const float mean_vals[3] = {127.5f, 127.5f, 127.5f};
     const float norm_vals[3] = {0.0078125f, 0.0078125f, 0.0078125f};
-    ncnn::Net Pnet;
-    ncnn::Net Rnet;
-    ncnn::Net Onet;
-    ncnn::Net Lnet;
-    vector<FaceInfo> Pnet_Detect(ncnn::Mat img);
-    vector<FaceInfo> Rnet_Detect(ncnn::Mat img, vector<FaceInfo> bboxs);
-    vector<FaceInfo> Onet_Detect(ncnn::Mat img, vector<FaceInfo> bboxs);
-    void Lnet_Detect(ncnn::Mat img, vector<FaceInfo> &bboxs);
-    vector<FaceInfo> generateBbox(ncnn::Mat score, ncnn::Mat loc, float scale, float thresh);
-    void doNms(vector<FaceInfo> &bboxs, float nms_thresh, string mode);
-    void refine(vector<FaceInfo> &bboxs, int height, int width, bool flag = false);
+    Network Pnet;
+    Network Rnet;
+    Network Onet;
+    Network Lnet;
+    bool folded[4];
+    BlobHandle pnet_data, pnet_prob, pnet_bbox;
+    BlobHandle rnet_data, rnet_prob, rnet_bbox;
+    BlobHandle onet_data, onet_prob, onet_bbox, onet_points;
+    BlobHandle lnet_data, lnet_points[5];
+    ThreadTable pnet_threads;
+    // OpenMP threads of the per box networks, 0 = not calibrated. at 0 or 1
+    // the boxes run in parallel, one thread each
+    int rnet_threads = 0;
+    int onet_threads = 0;
+    int lnet_threads = 0;
+    // deadline in ncnn::get_current_time() ms, 0 = none
+    void Pnet_Level(const ImageView& img, int level, double scale, int threads, vector<FaceInfo> &results, double deadline);
+    void Pnet_Detect(const ImageView& img, float minsize, vector<FaceInfo> &results, double deadline);
+    void Rnet_Detect(const ImageView& img, vector<FaceInfo> &bboxs, vector<FaceInfo> &results, double deadline);
+    void Onet_Detect(const ImageView& img, vector<FaceInfo> &bboxs, vector<FaceInfo> &results, double deadline);
+    void Lnet_Detect(const ImageView& img, vector<FaceInfo> &bboxs);
 };
 
 #endif
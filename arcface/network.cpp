@@ -0,0 +1,287 @@
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include "benchmark.h"
+#include "layer.h"
+#include "network.h"
+#include "graph.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+void Workspace::input(BlobHandle blob, const ncnn::Mat& in)
+{
+    if ((int)blobs.size() <= blob.index)
+        blobs.resize(blob.index + 1);
+    blobs[blob.index] = in;
+}
+
+const ncnn::Mat& Workspace::extract(BlobHandle blob) const
+{
+    return blobs[blob.index];
+}
+
+void Workspace::set_num_threads(int num_threads)
+{
+    this->num_threads = num_threads;
+}
+
+int ThreadTable::lookup(int size) const
+{
+    if (entries.empty())
+        return 0;
+    for (auto it = entries.begin(); it != entries.end(); it++)
+        if (it->first >= size)
+            return it->second;
+    return entries.back().second;
+}
+
+int ThreadTable::calibrate(const Network& net, BlobHandle input, int w, int h, int c, int iters)
+{
+    int max_threads = 1;
+#ifdef _OPENMP
+    max_threads = omp_get_max_threads();
+#endif
+    Workspace ws;
+    ncnn::Mat in(w, h, c);
+    in.fill(0.f);
+
+    int best = 1;
+    double best_time = 0;
+    for (int threads = 1; ; threads = min(threads * 2, max_threads))
+    {
+        ws.set_num_threads(threads);
+        ws.input(input, in);
+        net.forward(ws);
+        double start = ncnn::get_current_time();
+        for (int i = 0; i < iters; i++)
+        {
+            ws.input(input, in);
+            net.forward(ws);
+        }
+        double time = ncnn::get_current_time() - start;
+        // more threads have to be clearly faster to be worth their wake-up
+        if (threads == 1 || time < best_time * 0.9)
+        {
+            best = threads;
+            best_time = time;
+        }
+        if (threads == max_threads)
+            break;
+    }
+
+    auto it = entries.begin();
+    while (it != entries.end() && it->first < w * h)
+        it++;
+    if (it != entries.end() && it->first == w * h)
+        it->second = best;
+    else
+        entries.insert(it, make_pair(w * h, best));
+    return best;
+}
+
+Network::Network() : alive(new char(0))
+{
+}
+
+namespace {
+
+struct ThreadWorkspace {
+    weak_ptr<char> network;
+    const char* key;
+    int slot;
+    // the vector moves its elements, the workspaces stay in place
+    unique_ptr<Workspace> ws;
+};
+
+}
+
+Workspace& Network::threadWorkspace(int slot) const
+{
+    static thread_local vector<ThreadWorkspace> cache;
+    Workspace* found = 0;
+    for (auto it = cache.begin(); it != cache.end();)
+    {
+        if (it->network.expired())
+        {
+            it = cache.erase(it);
+            continue;
+        }
+        if (it->key == alive.get() && it->slot == slot)
+            found = it->ws.get();
+        it++;
+    }
+    if (found)
+        return *found;
+    ThreadWorkspace entry;
+    entry.network = alive;
+    entry.key = alive.get();
+    entry.slot = slot;
+    entry.ws.reset(new Workspace);
+    cache.push_back(move(entry));
+    return *cache.back().ws;
+}
+
+bool Network::load(const string& param_file, const string& bin_file,
+                   const float* mean, const float* norm, bool swap_rb)
+{
+    model = param_file;
+    bool folded = loadFolded(*this, param_file, bin_file, mean, norm, swap_rb);
+    plan();
+    return folded;
+}
+
+BlobHandle Network::resolve(const char* name) const
+{
+    BlobHandle handle;
+    handle.index = find_blob_index_by_name(name);
+    if (handle.index < 0)
+        throw runtime_error(model + ": no blob named " + name);
+    return handle;
+}
+
+// An in-place layer may overwrite its input only if nothing later reads that
+// memory. Split outputs and in-place results share memory with their input,
+// and the network inputs belong to the caller.
+void Network::plan()
+{
+    vector<int> storage(blobs.size());
+    vector<bool> external(blobs.size(), false);
+    for (size_t b = 0; b < blobs.size(); b++)
+        storage[b] = (int)b;
+
+    inplace.assign(layers.size(), false);
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        const ncnn::Layer* layer = layers[i];
+        if (layer->type == "Input")
+        {
+            for (auto t = layer->tops.begin(); t != layer->tops.end(); t++)
+                external[*t] = true;
+            continue;
+        }
+        if (layer->type == "Split")
+        {
+            for (auto t = layer->tops.begin(); t != layer->tops.end(); t++)
+                storage[*t] = storage[layer->bottoms[0]];
+            continue;
+        }
+        if (!layer->support_inplace)
+            continue;
+
+        bool writable = true;
+        for (auto b = layer->bottoms.begin(); b != layer->bottoms.end() && writable; b++)
+        {
+            int s = storage[*b];
+            if (external[s])
+                writable = false;
+            for (size_t m = 0; m < blobs.size() && writable; m++)
+            {
+                if (storage[m] != s)
+                    continue;
+                for (auto c = blobs[m].consumers.begin(); c != blobs[m].consumers.end(); c++)
+                    if (*c > (int)i)
+                        writable = false;
+            }
+        }
+        inplace[i] = writable;
+        if (writable)
+            for (size_t k = 0; k < layer->tops.size(); k++)
+                storage[layer->tops[k]] = storage[layer->bottoms[k]];
+    }
+}
+
+// copies into dst, reusing its buffer when the shape matches
+static void copyInto(const ncnn::Mat& src, ncnn::Mat& dst)
+{
+    if (src.dims == 1)
+        dst.create(src.w, src.elemsize);
+    else if (src.dims == 2)
+        dst.create(src.w, src.h, src.elemsize);
+    else
+        dst.create(src.w, src.h, src.c, src.elemsize);
+    memcpy(dst.data, src.data, src.total() * src.elemsize);
+}
+
+int Network::forward(Workspace& ws) const
+{
+    if (ws.blobs.size() < blobs.size())
+        ws.blobs.resize(blobs.size());
+    ws.inputs.resize(layers.size());
+    ws.outputs.resize(layers.size());
+
+#ifdef _OPENMP
+    int dynamic = omp_get_dynamic();
+    int num_threads = omp_get_max_threads();
+    if (ws.num_threads > 0)
+    {
+        omp_set_dynamic(0);
+        omp_set_num_threads(ws.num_threads);
+    }
+#endif
+
+    int ret = 0;
+    for (size_t i = 0; i < layers.size() && ret == 0; i++)
+    {
+        const ncnn::Layer* layer = layers[i];
+        // their blobs come from Workspace::input
+        if (layer->type == "Input")
+            continue;
+
+        vector<ncnn::Mat>& out = ws.outputs[i];
+        if (layer->one_blob_only)
+        {
+            const ncnn::Mat& bottom = ws.blobs[layer->bottoms[0]];
+            int top = layer->tops[0];
+            out.resize(1);
+            if (layer->support_inplace && inplace[i])
+            {
+                ws.blobs[top] = bottom;
+                ret = layer->forward_inplace(ws.blobs[top]);
+                continue;
+            }
+            if (layer->support_inplace)
+            {
+                copyInto(bottom, out[0]);
+                ret = layer->forward_inplace(out[0]);
+            }
+            else
+            {
+                ret = layer->forward(bottom, out[0]);
+            }
+            ws.blobs[top] = out[0];
+            continue;
+        }
+
+        vector<ncnn::Mat>& bottoms = ws.inputs[i];
+        bottoms.resize(layer->bottoms.size());
+        for (size_t k = 0; k < bottoms.size(); k++)
+            bottoms[k] = ws.blobs[layer->bottoms[k]];
+        out.resize(layer->tops.size());
+        if (layer->support_inplace)
+        {
+            for (size_t k = 0; k < bottoms.size(); k++)
+                if (inplace[i])
+                    out[k] = bottoms[k];
+                else
+                    copyInto(bottoms[k], out[k]);
+            ret = layer->forward_inplace(out);
+        }
+        else
+        {
+            ret = layer->forward(bottoms, out);
+        }
+        for (size_t k = 0; k < out.size(); k++)
+            ws.blobs[layer->tops[k]] = out[k];
+    }
+
+#ifdef _OPENMP
+    if (ws.num_threads > 0)
+    {
+        omp_set_dynamic(dynamic);
+        omp_set_num_threads(num_threads);
+    }
+#endif
+    return ret;
+}
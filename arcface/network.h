@@ -0,0 +1,88 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <utility>
+#include "net.h"
+
+using namespace std;
+
+// Index of a named blob, resolved once when the model is loaded so that the
+// per call Extractor::input/extract skip ncnn's linear search over blob names.
+struct BlobHandle {
+    int index = -1;
+};
+
+// Blob slots and layer outputs of one network, kept across forwards. Layers
+// write into the buffers of the previous call, so forwards with an unchanged
+// input shape allocate no blobs. Extracted blobs point into the workspace and
+// stay valid until its next forward. A workspace serves one thread at a time.
+class Workspace {
+public:
+    void input(BlobHandle blob, const ncnn::Mat& in);
+    const ncnn::Mat& extract(BlobHandle blob) const;
+    // OpenMP threads for the layers, 0 = the global setting
+    void set_num_threads(int num_threads);
+
+private:
+    friend class Network;
+    vector<ncnn::Mat> blobs;
+    // per layer argument lists, reused so that forwards build no vectors
+    vector<vector<ncnn::Mat> > inputs;
+    vector<vector<ncnn::Mat> > outputs;
+    int num_threads = 0;
+};
+
+class Network;
+
+// OpenMP thread counts of one network by input size (w * h), measured at
+// startup. Small forwards do better on one thread than waking up a team.
+class ThreadTable {
+public:
+    // threads for the smallest measured size not below size, 0 (the global
+    // setting) when nothing was measured
+    int lookup(int size) const;
+    // times forwards of zeros of the given shape with 1, 2, 4 ... threads up
+    // to the OpenMP maximum and keeps the fastest. returns the choice
+    int calibrate(const Network& net, BlobHandle input, int w, int h, int c, int iters = 5);
+    void clear() { entries.clear(); }
+
+private:
+    // (size, threads), ascending by size
+    vector<pair<int, int> > entries;
+};
+
+class Network : public ncnn::Net {
+public:
+    Network();
+
+    // loadFolded() that remembers the model for error messages. returns true if folded
+    bool load(const string& param_file, const string& bin_file,
+              const float* mean, const float* norm, bool swap_rb);
+
+    // throws runtime_error when the model has no blob of that name, which also
+    // covers a model that failed to load
+    BlobHandle resolve(const char* name) const;
+
+    // runs every layer on the blobs set with Workspace::input. return 0 if success
+    int forward(Workspace& ws) const;
+
+    // workspace number slot of the calling thread for this network. every
+    // thread gets its own, so one network can run on several threads at once.
+    // they are freed when the thread exits, or by its next call once the
+    // network is gone
+    Workspace& threadWorkspace(int slot = 0) const;
+
+private:
+    string model;
+    // expires with the network, which tells threads to drop its workspaces
+    shared_ptr<char> alive;
+    // per layer, whether an in-place layer may overwrite its input or needs a copy
+    vector<bool> inplace;
+
+    void plan();
+};
+
+#endif
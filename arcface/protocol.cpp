@@ -0,0 +1,131 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+
+// fills addr from "unix:PATH" or "tcp:PORT", returns its length or 0
+static socklen_t parseAddress(const string& address, sockaddr_storage& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    if (address.compare(0, 5, "unix:") == 0)
+    {
+        sockaddr_un* un = (sockaddr_un*)&addr;
+        string path = address.substr(5);
+        if (path.empty() || path.size() >= sizeof(un->sun_path))
+            return 0;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path.c_str());
+        return sizeof(sockaddr_un);
+    }
+    if (address.compare(0, 4, "tcp:") == 0)
+    {
+        sockaddr_in* in = (sockaddr_in*)&addr;
+        int port = atoi(address.c_str() + 4);
+        if (port <= 0 || port > 65535)
+            return 0;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return sizeof(sockaddr_in);
+    }
+    return 0;
+}
+
+int listenSocket(const string& address)
+{
+    sockaddr_storage addr;
+    socklen_t len = parseAddress(address, addr);
+    if (len == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (addr.ss_family == AF_UNIX)
+    {
+        // a socket file left by an earlier run
+        unlink(((sockaddr_un*)&addr)->sun_path);
+    }
+    else
+    {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    if (bind(fd, (sockaddr*)&addr, len) < 0 || listen(fd, 64) < 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int connectSocket(const string& address)
+{
+    sockaddr_storage addr;
+    socklen_t len = parseAddress(address, addr);
+    if (len == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (sockaddr*)&addr, len) < 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (addr.ss_family == AF_INET)
+    {
+        // requests are small and answered one at a time
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+}
+
+bool readFull(int fd, void* buf, size_t size)
+{
+    char* p = (char*)buf;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool writeFull(int fd, const void* buf, size_t size)
+{
+    const char* p = (const char*)buf;
+    while (size > 0)
+    {
+        // MSG_NOSIGNAL: a client that went away is an error, not a SIGPIPE
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
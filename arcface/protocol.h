@@ -0,0 +1,76 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Wire format of the server. Every message is a fixed header followed by its
+// payload. Integers are in host byte order, both ends run on one machine.
+
+const uint32_t PROTOCOL_MAGIC = 0x3146434e;
+
+// payloads above this are refused before anything is allocated
+const uint32_t MAX_PAYLOAD = 64 << 20;
+
+enum RequestType {
+    // width x height packed BGR pixels, detected, aligned and embedded
+    REQUEST_BGR = 1,
+    // a JPEG file, handled like REQUEST_BGR
+    REQUEST_JPEG = 2,
+    // count faces already aligned to 112x112 BGR pixels, only embedded
+    REQUEST_CROPS = 3,
+};
+
+struct RequestHeader {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t width;
+    uint32_t height;
+    uint32_t count;
+    // payload bytes
+    uint32_t size;
+};
+
+enum ResponseStatus {
+    STATUS_OK = 0,
+    STATUS_BAD_REQUEST = 1,
+    STATUS_DECODE_FAILED = 2,
+    // the server failed on a valid request, e.g. out of memory
+    STATUS_SERVER_ERROR = 3,
+};
+
+struct ResponseHeader {
+    uint32_t magic;
+    uint32_t status;
+    // face records that follow
+    uint32_t count;
+    // floats of each feature
+    uint32_t dim;
+    // microseconds from the end of the request to the reply, and the part
+    // of it spent waiting for an embedding batch
+    uint32_t total_us;
+    uint32_t queue_us;
+    // faces of the embedding batch the request ran in
+    uint32_t batch;
+};
+
+// followed by dim floats of its feature. box and landmarks are zero for crops
+struct FaceRecord {
+    float score;
+    int32_t box[4];
+    int32_t landmark[10];
+};
+
+// "unix:PATH" or "tcp:PORT", which binds 127.0.0.1 only. return a socket
+// descriptor, -1 on failure with errno set
+int listenSocket(const string& address);
+int connectSocket(const string& address);
+
+// loop over short reads and writes. return false on error or end of stream
+bool readFull(int fd, void* buf, size_t size);
+bool writeFull(int fd, const void* buf, size_t size);
+
+#endif
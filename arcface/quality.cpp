@@ -0,0 +1,70 @@
+#include <algorithm>
+#include "quality.h"
+
+using namespace std;
+
+// 0 at bad, 1 at good, linear in between. bad may be above good
+static float ramp(float value, float bad, float good)
+{
+    if (bad == good)
+        return value >= good ? 1.f : 0.f;
+    return min(1.f, max(0.f, (value - bad) / (good - bad)));
+}
+
+bool QualityGate::Check(const FaceInfo& info, FaceQuality& quality) const
+{
+    float side = (float)min(info.x[1] - info.x[0], info.y[1] - info.y[0]);
+    quality.size = ramp(side, min_size, good_size);
+    quality.score = ramp(info.score, min_score, good_score);
+
+    // offset of the nose along the eye axis, so roll does not count as yaw
+    float ex = (float)(info.landmark[2] - info.landmark[0]);
+    float ey = (float)(info.landmark[3] - info.landmark[1]);
+    float nx = info.landmark[4] - (info.landmark[0] + info.landmark[2]) * 0.5f;
+    float ny = info.landmark[5] - (info.landmark[1] + info.landmark[3]) * 0.5f;
+    float eye2 = ex * ex + ey * ey;
+    float yaw = eye2 > 0 ? fabs(nx * ex + ny * ey) * 2.f / eye2 : 1.f;
+    quality.pose = ramp(yaw, max_yaw, good_yaw);
+
+    quality.sharpness = 1.f;
+    quality.total = min(min(quality.size, quality.score), quality.pose);
+    return quality.total >= threshold;
+}
+
+bool QualityGate::CheckCrop(ncnn::Mat aligned, FaceQuality& quality) const
+{
+    quality.sharpness = ramp(laplacianVariance(aligned), min_sharpness, good_sharpness);
+    quality.total = min(quality.total, quality.sharpness);
+    return quality.total >= threshold;
+}
+
+float laplacianVariance(ncnn::Mat img)
+{
+    int w = img.w;
+    int h = img.h;
+    int border = min(w, h) / 8 + 1;
+    if (w <= 2 * border || h <= 2 * border)
+        return 0.f;
+
+    const float* r = img.channel(0);
+    const float* g = img.channel(img.c > 1 ? 1 : 0);
+    const float* b = img.channel(img.c > 2 ? 2 : 0);
+    double sum = 0, sum2 = 0;
+    int count = 0;
+    for (int y = border; y < h - border; y++)
+    {
+        for (int x = border; x < w - border; x++)
+        {
+            int i = y * w + x;
+            float center = r[i] + g[i] + b[i];
+            float around = r[i - 1] + g[i - 1] + b[i - 1] + r[i + 1] + g[i + 1] + b[i + 1]
+                         + r[i - w] + g[i - w] + b[i - w] + r[i + w] + g[i + w] + b[i + w];
+            float lap = (around - 4.f * center) / 3.f;
+            sum += lap;
+            sum2 += lap * lap;
+            count++;
+        }
+    }
+    double mean = sum / count;
+    return (float)(sum2 / count - mean * mean);
+}
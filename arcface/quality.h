@@ -0,0 +1,50 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include "net.h"
+#include "base.h"
+
+// Every component is in [0, 1], 1 being good enough that it never decides
+// the outcome. total is the smallest component.
+struct FaceQuality {
+    float size;
+    float score;
+    float pose;
+    float sharpness;
+    float total;
+};
+
+// Rejects faces that cannot produce a useful embedding before getFeature runs.
+// Check() needs only the detection and runs before preprocess, CheckCrop()
+// looks at the aligned crop, so faces rejected by the first are never warped.
+class QualityGate {
+public:
+    // shorter box side in pixels, ramping from min_size to good_size
+    float min_size = 32;
+    float good_size = 64;
+    // onet score
+    float min_score = 0.9f;
+    float good_score = 0.99f;
+    // nose offset from the eye midpoint relative to half the eye distance,
+    // 0 for a frontal face and 1 with the nose under one eye
+    float max_yaw = 0.7f;
+    float good_yaw = 0.3f;
+    // variance of the laplacian of the aligned crop
+    float min_sharpness = 15.f;
+    float good_sharpness = 75.f;
+    // faces whose total is below this are dropped
+    float threshold = 0.5f;
+
+    // fills size, score and pose; sharpness is left at 1. returns false when
+    // the face is already below the threshold
+    bool Check(const FaceInfo& info, FaceQuality& quality) const;
+    // fills sharpness from the aligned crop of preprocess() and updates total.
+    // returns false when the face is below the threshold
+    bool CheckCrop(ncnn::Mat aligned, FaceQuality& quality) const;
+};
+
+// variance of the 4-neighbour laplacian over the gray levels of the crop,
+// skipping the border that warpAffineMatrix fills for faces near the edge
+float laplacianVariance(ncnn::Mat img);
+
+#endif
@@ -0,0 +1,169 @@
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include "benchmark.h"
+#include "scheduler.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+EmbedScheduler::EmbedScheduler(string model_folder, int workers, int max_batch, bool int8)
+    : max_batch(max(max_batch, 1))
+{
+    workers = max(workers, 1);
+    for (int i = 0; i < workers; i++)
+        arcs.push_back(new Arcface(model_folder, int8));
+
+    // first estimate from a warm forward, refined by every batch
+    ncnn::Mat face(112, 112, 3);
+    face.fill(0.f);
+    arcs[0]->getFeature(face);
+    double start = ncnn::get_current_time();
+    arcs[0]->getFeature(face);
+    face_ms = ncnn::get_current_time() - start;
+
+    // the workers run side by side, the OpenMP threads are shared out
+    int threads = 1;
+#ifdef _OPENMP
+    threads = max(omp_get_max_threads() / workers, 1);
+#endif
+    for (int i = 0; i < workers; i++)
+        this->workers.push_back(thread(&EmbedScheduler::run, this, i, threads));
+}
+
+EmbedScheduler::~EmbedScheduler()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    arrived.notify_all();
+    for (auto it = workers.begin(); it != workers.end(); it++)
+        it->join();
+    for (auto it = arcs.begin(); it != arcs.end(); it++)
+        delete *it;
+}
+
+future<EmbedResult> EmbedScheduler::submit(const ncnn::Mat& faces, double deadline)
+{
+    if (faces.empty())
+    {
+        promise<EmbedResult> empty;
+        empty.set_value(EmbedResult{vector<vector<float> >(), 0, 0});
+        return empty.get_future();
+    }
+    // the batch is built of 112x112 float planes, anything else would not fit
+    if (faces.dims != 3 || faces.w != 112 || faces.h != 112 || faces.c % 3 != 0 || faces.elemsize != sizeof(float))
+    {
+        promise<EmbedResult> rejected;
+        rejected.set_exception(make_exception_ptr(invalid_argument("faces are not 112x112 crops of 3 channels each")));
+        return rejected.get_future();
+    }
+    Request* request = new Request;
+    request->faces = faces;
+    request->deadline = deadline;
+    future<EmbedResult> result = request->result.get_future();
+    {
+        lock_guard<mutex> guard(lock);
+        request->queued = ncnn::get_current_time();
+        queue.insert(make_pair(deadline, request));
+        pending += faces.c / 3;
+    }
+    arrived.notify_all();
+    return result;
+}
+
+SchedulerStats EmbedScheduler::stats() const
+{
+    lock_guard<mutex> guard(lock);
+    return counters;
+}
+
+double EmbedScheduler::estimate(int faces) const
+{
+    return face_ms * faces;
+}
+
+void EmbedScheduler::run(int worker, int threads)
+{
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    Arcface& arc = *arcs[worker];
+    arc.CalibrateThreads();
+
+    vector<Request*> requests;
+    vector<vector<float> > features;
+    ncnn::Mat batch;
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+        if (queue.empty())
+        {
+            if (stopping)
+                return;
+            arrived.wait(guard);
+            continue;
+        }
+        // wait while one more face would still make the earliest deadline
+        if (pending < max_batch && !stopping)
+        {
+            double flush = queue.begin()->first - estimate(min(pending + 1, max_batch));
+            double now = ncnn::get_current_time();
+            if (now < flush)
+            {
+                arrived.wait_for(guard, chrono::microseconds((long)((flush - now) * 1000)));
+                continue;
+            }
+        }
+
+        // earliest deadlines first, whole requests only; one larger than
+        // max_batch runs alone
+        int n = 0;
+        requests.clear();
+        while (!queue.empty() && (n == 0 || n + queue.begin()->second->faces.c / 3 <= max_batch))
+        {
+            Request* request = queue.begin()->second;
+            n += request->faces.c / 3;
+            requests.push_back(request);
+            queue.erase(queue.begin());
+        }
+        pending -= n;
+        guard.unlock();
+
+        double started = ncnn::get_current_time();
+        batch.create(112, 112, 3 * n);
+        // plane by plane, the requests may have been made with another cstep
+        int channel = 0;
+        for (auto it = requests.begin(); it != requests.end(); it++)
+            for (int c = 0; c < (*it)->faces.c; c++)
+                memcpy(batch.channel(channel++), (*it)->faces.channel(c), 112 * 112 * sizeof(float));
+        arc.getFeatures(batch, features);
+        double finished = ncnn::get_current_time();
+
+        int late = 0;
+        auto feature = features.begin();
+        for (auto it = requests.begin(); it != requests.end(); it++)
+        {
+            int k = (*it)->faces.c / 3;
+            EmbedResult result;
+            result.features.assign(feature, feature + k);
+            result.queue_ms = started - (*it)->queued;
+            result.batch = n;
+            feature += k;
+            if (finished > (*it)->deadline)
+                late++;
+            (*it)->result.set_value(move(result));
+            delete *it;
+        }
+
+        guard.lock();
+        face_ms = 0.8 * face_ms + 0.2 * (finished - started) / n;
+        counters.batches++;
+        counters.faces += n;
+        counters.requests += requests.size();
+        counters.late += late;
+    }
+}
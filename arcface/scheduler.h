@@ -0,0 +1,79 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <map>
+#include <mutex>
+#include <future>
+#include <thread>
+#include <vector>
+#include <string>
+#include <condition_variable>
+#include "net.h"
+#include "arcface.h"
+
+using namespace std;
+
+struct EmbedResult {
+    // one per face, in the order they were submitted
+    vector<vector<float> > features;
+    // from submit() to the start of the batch
+    double queue_ms;
+    // faces in that batch
+    int batch;
+};
+
+struct SchedulerStats {
+    long batches = 0;
+    long faces = 0;
+    long requests = 0;
+    // requests finished after their deadline
+    long late = 0;
+
+    double meanBatch() const { return batches ? (double)faces / batches : 0; }
+};
+
+// Collects aligned faces from any number of threads into batches for a fixed
+// pool of embedding workers, each with its own Arcface. Waiting lets batches
+// grow, so a batch is only started when it is full or when waiting any longer
+// would miss the earliest deadline in the queue, given the measured time per
+// face. Queued requests are taken earliest deadline first.
+class EmbedScheduler {
+public:
+    // throws runtime_error when the model cannot be loaded
+    EmbedScheduler(string model_folder, int workers = 1, int max_batch = 16, bool int8 = false);
+    // finishes the queued requests first
+    ~EmbedScheduler();
+
+    // faces as made by preprocessAll(), 112x112 with 3 channels per face.
+    // deadline is in ncnn::get_current_time() milliseconds. other shapes are
+    // rejected, the future then throws invalid_argument
+    future<EmbedResult> submit(const ncnn::Mat& faces, double deadline);
+
+    SchedulerStats stats() const;
+
+private:
+    struct Request {
+        ncnn::Mat faces;
+        double deadline;
+        double queued;
+        promise<EmbedResult> result;
+    };
+
+    int max_batch;
+    vector<Arcface*> arcs;
+    vector<thread> workers;
+    mutable mutex lock;
+    condition_variable arrived;
+    // by deadline
+    multimap<double, Request*> queue;
+    int pending = 0;
+    bool stopping = false;
+    // running estimate of the embedding time per face
+    double face_ms;
+    SchedulerStats counters;
+
+    double estimate(int faces) const;
+    void run(int worker, int threads);
+};
+
+#endif
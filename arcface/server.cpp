@@ -0,0 +1,295 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <exception>
+#include <condition_variable>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "benchmark.h"
+#include "arcface.h"
+#include "mtcnn.h"
+#include "jpegimage.h"
+#include "protocol.h"
+#include "scheduler.h"
+using namespace std;
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Serves detection and embedding on a Unix socket or localhost TCP, see
+// protocol.h. Every connection gets a thread, up to --max-connections at a
+// time, and they all detect with one shared detector; the aligned faces of
+// all connections go to one EmbedScheduler, which batches them as far as
+// each request's latency target allows.
+
+struct ServerOptions {
+    string address = "unix:/tmp/insightface.sock";
+    string model_folder = "../models";
+    int max_batch = 16;
+    int workers = 1;
+    // latency target of a request, from its arrival to the reply
+    double slo = 1000;
+    // OpenMP threads of each connection's detector. requests of different
+    // connections already run in parallel
+    int detect_threads = 1;
+    // further clients wait in the listen backlog
+    int max_connections = 64;
+    bool verbose = false;
+};
+
+// counts the connections being served
+struct ConnectionSlots {
+    mutex lock;
+    condition_variable freed;
+    int active = 0;
+};
+
+struct Connection {
+    int fd;
+    const ServerOptions* opt;
+    EmbedScheduler* scheduler;
+    MtcnnDetector* detector;
+    ConnectionSlots* slots;
+};
+
+static bool reply(int fd, const ResponseHeader& header, const vector<FaceInfo>& faces,
+                  const vector<vector<float> >& features)
+{
+    vector<char> out(sizeof(header) + header.count * (sizeof(FaceRecord) + header.dim * sizeof(float)));
+    char* p = out.data();
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        FaceRecord record;
+        memset(&record, 0, sizeof(record));
+        if (i < faces.size())
+        {
+            record.score = faces[i].score;
+            record.box[0] = faces[i].x[0];
+            record.box[1] = faces[i].y[0];
+            record.box[2] = faces[i].x[1];
+            record.box[3] = faces[i].y[1];
+            for (int k = 0; k < 10; k++)
+                record.landmark[k] = faces[i].landmark[k];
+        }
+        memcpy(p, &record, sizeof(record));
+        p += sizeof(record);
+        memcpy(p, features[i].data(), header.dim * sizeof(float));
+        p += header.dim * sizeof(float);
+    }
+    return writeFull(fd, out.data(), out.size());
+}
+
+static void serve(Connection conn)
+{
+#ifdef _OPENMP
+    omp_set_num_threads(conn.opt->detect_threads);
+#endif
+    vector<unsigned char> payload;
+    vector<FaceInfo> faces;
+    JpegImage jpeg;
+    RequestHeader request;
+    while (readFull(conn.fd, &request, sizeof(request)))
+    {
+        if (request.magic != PROTOCOL_MAGIC || request.size > MAX_PAYLOAD)
+            break;
+        payload.resize(request.size);
+        if (!readFull(conn.fd, payload.data(), payload.size()))
+            break;
+        double start = ncnn::get_current_time();
+
+        ResponseHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = PROTOCOL_MAGIC;
+        faces.clear();
+        ncnn::Mat crops;
+        EmbedResult result;
+        // a failure of one request is answered, it does not take the server down
+        try
+        {
+            if (request.type == REQUEST_BGR || request.type == REQUEST_JPEG)
+            {
+                if (request.type == REQUEST_BGR)
+                {
+                    if (request.width == 0 || request.height == 0 ||
+                        (uint64_t)request.width * request.height * 3 != request.size)
+                        header.status = STATUS_BAD_REQUEST;
+                    else
+                    {
+                        ImageView view(payload.data(), request.width, request.height, request.width * 3);
+                        conn.detector->Detect(view, faces);
+                        crops = preprocessAll(view, faces);
+                    }
+                }
+                else if (!jpeg.open(payload.data(), payload.size()))
+                    header.status = STATUS_DECODE_FAILED;
+                else
+                {
+                    crops = detectAligned(*conn.detector, jpeg, faces);
+                    if (crops.empty() && !faces.empty())
+                        header.status = STATUS_DECODE_FAILED;
+                }
+            }
+            else if (request.type == REQUEST_CROPS)
+            {
+                if (request.count == 0 || (uint64_t)request.count * 112 * 112 * 3 != request.size)
+                    header.status = STATUS_BAD_REQUEST;
+                else
+                {
+                    crops.create(112, 112, 3 * (int)request.count);
+                    for (uint32_t i = 0; i < request.count; i++)
+                    {
+                        ncnn::Mat face = ncnn::Mat::from_pixels(payload.data() + i * 112 * 112 * 3,
+                                                                ncnn::Mat::PIXEL_BGR, 112, 112);
+                        memcpy(crops.channel(3 * i), (const float*)face, face.cstep * 3 * sizeof(float));
+                    }
+                }
+            }
+            else
+                header.status = STATUS_BAD_REQUEST;
+
+            if (header.status == STATUS_OK && !crops.empty())
+            {
+                result = conn.scheduler->submit(crops, start + conn.opt->slo).get();
+                header.count = result.features.size();
+                header.dim = header.count ? result.features[0].size() : 0;
+                header.queue_us = (uint32_t)(result.queue_ms * 1000);
+                header.batch = result.batch;
+            }
+        }
+        catch (const exception& e)
+        {
+            fprintf(stderr, "fd %d: %s\n", conn.fd, e.what());
+            header.status = STATUS_SERVER_ERROR;
+            header.count = 0;
+            header.dim = 0;
+            result.features.clear();
+        }
+        double end = ncnn::get_current_time();
+        header.total_us = (uint32_t)((end - start) * 1000);
+        if (conn.opt->verbose)
+            fprintf(stderr, "fd %d type %u status %u faces %u batch %u queue %.2f ms total %.2f ms\n",
+                    conn.fd, request.type, header.status, header.count, header.batch,
+                    header.queue_us / 1000.0, header.total_us / 1000.0);
+        if (!reply(conn.fd, header, faces, result.features))
+            break;
+    }
+    close(conn.fd);
+    {
+        lock_guard<mutex> guard(conn.slots->lock);
+        conn.slots->active--;
+    }
+    conn.slots->freed.notify_one();
+    if (conn.opt->verbose)
+    {
+        SchedulerStats stats = conn.scheduler->stats();
+        fprintf(stderr, "fd %d closed; %ld requests in %ld batches of %.1f faces, %ld late\n",
+                conn.fd, stats.requests, stats.batches, stats.meanBatch(), stats.late);
+    }
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--listen unix:PATH|tcp:PORT] [--models DIR] [--max-batch N] [--slo MS]\n"
+            "       [--workers N] [--detect-threads N] [--max-connections N] [--verbose]\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+    ServerOptions opt;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--listen" && i + 1 < argc)
+            opt.address = argv[++i];
+        else if (arg == "--models" && i + 1 < argc)
+            opt.model_folder = argv[++i];
+        else if (arg == "--max-batch" && i + 1 < argc)
+            opt.max_batch = atoi(argv[++i]);
+        else if (arg == "--slo" && i + 1 < argc)
+            opt.slo = atof(argv[++i]);
+        else if (arg == "--workers" && i + 1 < argc)
+            opt.workers = atoi(argv[++i]);
+        else if (arg == "--detect-threads" && i + 1 < argc)
+            opt.detect_threads = atoi(argv[++i]);
+        else if (arg == "--max-connections" && i + 1 < argc)
+            opt.max_connections = atoi(argv[++i]);
+        else if (arg == "--verbose")
+            opt.verbose = true;
+        else
+        {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (opt.max_batch <= 0 || opt.slo <= 0 || opt.workers <= 0 || opt.detect_threads <= 0 ||
+        opt.max_connections <= 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    // Detect runs on many threads at once, one detector serves every connection
+    unique_ptr<MtcnnDetector> detector;
+    unique_ptr<EmbedScheduler> scheduler;
+    try
+    {
+        detector.reset(new MtcnnDetector(opt.model_folder));
+        scheduler.reset(new EmbedScheduler(opt.model_folder, opt.workers, opt.max_batch));
+    }
+    catch (const exception& e)
+    {
+        fprintf(stderr, "cannot load the models: %s\n", e.what());
+        return -1;
+    }
+    ConnectionSlots slots;
+
+    int fd = listenSocket(opt.address);
+    if (fd < 0)
+    {
+        fprintf(stderr, "failed to listen on %s: %s\n", opt.address.c_str(), strerror(errno));
+        return -1;
+    }
+    fprintf(stderr, "listening on %s, %d embedding workers, batches of up to %d faces, %g ms target\n",
+            opt.address.c_str(), opt.workers, opt.max_batch, opt.slo);
+
+    while (true)
+    {
+        {
+            unique_lock<mutex> guard(slots.lock);
+            while (slots.active >= opt.max_connections)
+                slots.freed.wait(guard);
+        }
+        int client = accept(fd, 0, 0);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            break;
+        }
+        int on = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        Connection conn;
+        conn.fd = client;
+        conn.opt = &opt;
+        conn.scheduler = scheduler.get();
+        conn.detector = detector.get();
+        conn.slots = &slots;
+        {
+            lock_guard<mutex> guard(slots.lock);
+            slots.active++;
+        }
+        thread(serve, conn).detach();
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <dirent.h>
+#include <unistd.h>
+#include "gallery.h"
+#include "epoch.h"
+using namespace std;
+
+// Searches a gallery from several threads while others enroll into it and
+// compact it, and checks that every face is found as soon as its enroll()
+// returned, and again after the gallery is reopened. Meant to be built with
+// -fsanitize=thread, see the stress target of the Makefile. Exits 1 when a
+// check fails.
+
+struct StressOptions {
+    string dir;
+    int seconds = 10;
+    int readers = 4;
+    int writers = 2;
+    int max_rows = 100000;
+    size_t auto_compact = 256 * 1024;
+};
+
+static const int DIM = 128;
+
+// the feature of row id, the same every time it is asked for
+static vector<float> rowFeature(unsigned int id)
+{
+    vector<float> feature(DIM);
+    unsigned int state = id * 2654435761u + 1;
+    float norm = 0;
+    for (int i = 0; i < DIM; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        feature[i] = (state & 0xffff) / 32767.5f - 1.f;
+        norm += feature[i] * feature[i];
+    }
+    norm = sqrt(norm);
+    for (int i = 0; i < DIM; i++)
+        feature[i] /= norm;
+    return feature;
+}
+
+static string rowName(unsigned int id)
+{
+    return "row" + to_string(id);
+}
+
+// the row is the best match of its own feature
+static bool findsRow(const Gallery& gallery, unsigned int id)
+{
+    vector<GalleryMatch> matches = gallery.search(rowFeature(id), 1);
+    return !matches.empty() && matches[0].name == rowName(id) && matches[0].similarity > 0.999f;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--dir DIR] [--seconds N] [--readers N] [--writers N] [--rows N] [--compact BYTES]\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+    StressOptions opt;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--dir" && i + 1 < argc)
+            opt.dir = argv[++i];
+        else if (arg == "--seconds" && i + 1 < argc)
+            opt.seconds = atoi(argv[++i]);
+        else if (arg == "--readers" && i + 1 < argc)
+            opt.readers = atoi(argv[++i]);
+        else if (arg == "--writers" && i + 1 < argc)
+            opt.writers = atoi(argv[++i]);
+        else if (arg == "--rows" && i + 1 < argc)
+            opt.max_rows = atoi(argv[++i]);
+        else if (arg == "--compact" && i + 1 < argc)
+            opt.auto_compact = strtoul(argv[++i], 0, 10);
+        else
+        {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (opt.seconds <= 0 || opt.readers <= 0 || opt.writers <= 0 || opt.max_rows <= 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    bool own_dir = opt.dir.empty();
+    if (own_dir)
+    {
+        char dir[] = "/tmp/stress-gallery-XXXXXX";
+        if (!mkdtemp(dir))
+        {
+            fprintf(stderr, "cannot create a gallery directory\n");
+            return -1;
+        }
+        opt.dir = dir;
+    }
+
+    // enrolled[id] is set once the enroll() of row id returned
+    vector<atomic<bool> > enrolled(opt.max_rows);
+    for (auto it = enrolled.begin(); it != enrolled.end(); it++)
+        *it = false;
+    atomic<int> next_row(0);
+    atomic<bool> stop(false);
+    atomic<long> searches(0);
+    atomic<int> failures(0);
+    int rows = 0;
+    {
+        Gallery gallery(opt.dir, DIM);
+        gallery.setAutoCompact(opt.auto_compact);
+
+        vector<thread> threads;
+        for (int w = 0; w < opt.writers; w++)
+            threads.push_back(thread([&]() {
+                while (!stop)
+                {
+                    int id = next_row++;
+                    if (id >= opt.max_rows)
+                        break;
+                    if (gallery.enroll(rowName(id), rowFeature(id), false) < 0)
+                    {
+                        fprintf(stderr, "enroll of row %d failed\n", id);
+                        failures++;
+                        continue;
+                    }
+                    enrolled[id] = true;
+                }
+            }));
+        for (int r = 0; r < opt.readers; r++)
+            threads.push_back(thread([&, r]() {
+                unsigned int state = r + 1;
+                while (!stop)
+                {
+                    int limit = min((int)next_row, opt.max_rows);
+                    if (limit == 0)
+                        continue;
+                    state = state * 1103515245 + 12345;
+                    int id = (state >> 8) % limit;
+                    bool done = enrolled[id];
+                    int size = gallery.size();
+                    if (done && !findsRow(gallery, id))
+                    {
+                        fprintf(stderr, "row %d was enrolled but is not found, gallery size %d\n", id, size);
+                        failures++;
+                    }
+                    searches++;
+                }
+            }));
+
+        this_thread::sleep_for(chrono::seconds(opt.seconds));
+        stop = true;
+        for (auto it = threads.begin(); it != threads.end(); it++)
+            it->join();
+        rows = gallery.size();
+        printf("%d rows enrolled, %ld searches, %d objects waiting to be freed\n", rows, (long)searches, reclaim());
+    }
+
+    // everything acknowledged survives a reopen, from gallery.bin or the log
+    {
+        Gallery gallery(opt.dir, DIM);
+        int acknowledged = 0;
+        for (int id = 0; id < opt.max_rows; id++)
+        {
+            if (!enrolled[id])
+                continue;
+            acknowledged++;
+            if (id % 97 == 0 && !findsRow(gallery, id))
+            {
+                fprintf(stderr, "row %d is lost after reopening\n", id);
+                failures++;
+            }
+        }
+        if (gallery.size() != acknowledged)
+        {
+            fprintf(stderr, "%d rows after reopening, %d were enrolled\n", gallery.size(), acknowledged);
+            failures++;
+        }
+    }
+
+    if (own_dir)
+    {
+        DIR* d = opendir(opt.dir.c_str());
+        if (d)
+        {
+            for (dirent* e = readdir(d); e; e = readdir(d))
+                if (string(e->d_name) != "." && string(e->d_name) != "..")
+                    unlink((opt.dir + "/" + e->d_name).c_str());
+            closedir(d);
+        }
+        rmdir(opt.dir.c_str());
+    }
+    printf("%d failures\n", (int)failures);
+    return failures ? 1 : 0;
+}
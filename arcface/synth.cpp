@@ -0,0 +1,223 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <algorithm>
+#include "synth.h"
+#include "jpegimage.h"
+
+vector<FaceSource> loadFaceSources(MtcnnDetector& detector, const vector<string>& paths)
+{
+    vector<FaceSource> sources;
+    JpegImage jpeg;
+    for (auto path = paths.begin(); path != paths.end(); path++)
+    {
+        if (!jpeg.open(*path))
+            continue;
+        ncnn::Mat img = jpeg.decode();
+        if (img.empty())
+            continue;
+        vector<FaceInfo> faces = detector.Detect(img);
+        if (faces.empty())
+            continue;
+        FaceInfo best = *max_element(faces.begin(), faces.end(),
+                                     [](const FaceInfo& a, const FaceInfo& b) { return a.score < b.score; });
+
+        int side = max(best.x[1] - best.x[0], best.y[1] - best.y[0]);
+        int x0 = max(0, best.x[0] - side / 2);
+        int y0 = max(0, best.y[0] - side / 2);
+        int x1 = min(img.w, best.x[1] + side / 2);
+        int y1 = min(img.h, best.y[1] + side / 2);
+        vector<unsigned char> pixels(img.w * img.h * 3);
+        img.to_pixels(pixels.data(), ncnn::Mat::PIXEL_BGR);
+
+        FaceSource source;
+        source.w = x1 - x0;
+        source.h = y1 - y0;
+        source.pixels.resize(source.w * source.h * 3);
+        for (int y = 0; y < source.h; y++)
+            memcpy(&source.pixels[y * source.w * 3], &pixels[((y0 + y) * img.w + x0) * 3], source.w * 3);
+        source.face = best;
+        for (int i = 0; i < 2; i++)
+        {
+            source.face.x[i] -= x0;
+            source.face.y[i] -= y0;
+        }
+        for (int i = 0; i < 5; i++)
+        {
+            source.face.landmark[2 * i] -= x0;
+            source.face.landmark[2 * i + 1] -= y0;
+        }
+        sources.push_back(source);
+    }
+    return sources;
+}
+
+vector<unsigned char> composeFrame(const vector<FaceSource>& sources, const FrameSpec& spec, vector<FaceInfo>& truth)
+{
+    int w = spec.width;
+    int h = spec.height;
+    vector<unsigned char> frame((size_t)w * h * 3);
+    mt19937 rng(spec.seed);
+
+    // gradients with blocks of noise, enough texture for pnet to find some
+    // candidates outside the faces
+    float gx[3], gy[3];
+    for (int c = 0; c < 3; c++)
+    {
+        gx[c] = (rng() % 160) / (float)w;
+        gy[c] = (rng() % 160) / (float)h;
+    }
+    vector<unsigned char> noise(((w + 7) / 8) * ((h + 7) / 8));
+    for (auto it = noise.begin(); it != noise.end(); it++)
+        *it = rng() % 64;
+    for (int y = 0; y < h; y++)
+    {
+        unsigned char* row = &frame[(size_t)y * w * 3];
+        const unsigned char* blocks = &noise[(y / 8) * ((w + 7) / 8)];
+        for (int x = 0; x < w; x++)
+            for (int c = 0; c < 3; c++)
+                row[3 * x + c] = (unsigned char)min(255, (int)(48 + gx[c] * x + gy[c] * y) + blocks[x / 8]);
+    }
+
+    truth.clear();
+    if (sources.empty())
+        return frame;
+    // pasted regions as x0, y0, x1, y1
+    vector<int> placed;
+    uniform_real_distribution<float> log_side(log((float)spec.min_face), log((float)max(spec.min_face, spec.max_face)));
+    for (int i = 0; i < spec.faces; i++)
+    {
+        const FaceSource& source = sources[i % sources.size()];
+        int box = max(source.face.x[1] - source.face.x[0], source.face.y[1] - source.face.y[0]);
+        float scale = exp(log_side(rng)) / box;
+        int pw = (int)(source.w * scale);
+        int ph = (int)(source.h * scale);
+        if (pw < 1 || ph < 1 || pw > w || ph > h)
+            continue;
+
+        int px = 0, py = 0;
+        bool free = false;
+        for (int attempt = 0; attempt < 50 && !free; attempt++)
+        {
+            px = rng() % (w - pw + 1);
+            py = rng() % (h - ph + 1);
+            free = true;
+            for (size_t r = 0; r < placed.size() && free; r += 4)
+                free = px >= placed[r + 2] || px + pw <= placed[r] || py >= placed[r + 3] || py + ph <= placed[r + 1];
+        }
+        if (!free)
+            continue;
+        placed.push_back(px);
+        placed.push_back(py);
+        placed.push_back(px + pw);
+        placed.push_back(py + ph);
+
+        ImageView view(source.pixels.data(), source.w, source.h, source.w * 3);
+        ncnn::Mat face = cropResize(view, 0, 0, source.w, source.h, pw, ph);
+        for (int y = 0; y < ph; y++)
+        {
+            unsigned char* row = &frame[((size_t)(py + y) * w + px) * 3];
+            for (int c = 0; c < 3; c++)
+            {
+                const float* src = (const float*)face.channel(c) + y * pw;
+                for (int x = 0; x < pw; x++)
+                    row[3 * x + c] = (unsigned char)max(0.f, min(255.f, src[x] + 0.5f));
+            }
+        }
+
+        FaceInfo info = source.face;
+        float sx = (float)pw / source.w;
+        float sy = (float)ph / source.h;
+        for (int k = 0; k < 2; k++)
+        {
+            info.x[k] = px + (int)(source.face.x[k] * sx);
+            info.y[k] = py + (int)(source.face.y[k] * sy);
+        }
+        for (int k = 0; k < 5; k++)
+        {
+            info.landmark[2 * k] = px + (int)(source.face.landmark[2 * k] * sx);
+            info.landmark[2 * k + 1] = py + (int)(source.face.landmark[2 * k + 1] * sy);
+        }
+        info.score = 1;
+        info.area = (float)(info.x[1] - info.x[0]) * (info.y[1] - info.y[0]);
+        truth.push_back(info);
+    }
+    return frame;
+}
+
+bool parseSizeList(const string& text, vector<pair<int, int> >& sizes)
+{
+    sizes.clear();
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == string::npos)
+            end = text.size();
+        int w, h;
+        char tail;
+        if (sscanf(text.substr(start, end - start).c_str(), "%dx%d%c", &w, &h, &tail) != 2 || w <= 0 || h <= 0)
+            return false;
+        sizes.push_back(make_pair(w, h));
+        start = end + 1;
+    }
+    return true;
+}
+
+bool parseIntList(const string& text, vector<int>& values)
+{
+    values.clear();
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == string::npos)
+            end = text.size();
+        int v;
+        char tail;
+        if (sscanf(text.substr(start, end - start).c_str(), "%d%c", &v, &tail) != 1 || v < 0)
+            return false;
+        values.push_back(v);
+        start = end + 1;
+    }
+    return true;
+}
+
+static float iou(const FaceInfo& a, const FaceInfo& b)
+{
+    int iw = min(a.x[1], b.x[1]) - max(a.x[0], b.x[0]);
+    int ih = min(a.y[1], b.y[1]) - max(a.y[0], b.y[0]);
+    if (iw <= 0 || ih <= 0)
+        return 0;
+    float inter = (float)iw * ih;
+    float area_a = (float)(a.x[1] - a.x[0]) * (a.y[1] - a.y[0]);
+    float area_b = (float)(b.x[1] - b.x[0]) * (b.y[1] - b.y[0]);
+    return inter / (area_a + area_b - inter);
+}
+
+int matchFaces(const vector<FaceInfo>& truth, const vector<FaceInfo>& found, float min_iou)
+{
+    vector<bool> used(found.size(), false);
+    int matched = 0;
+    for (auto t = truth.begin(); t != truth.end(); t++)
+    {
+        int best = -1;
+        float best_iou = min_iou;
+        for (size_t i = 0; i < found.size(); i++)
+        {
+            float v = used[i] ? 0 : iou(*t, found[i]);
+            if (v >= best_iou)
+            {
+                best = i;
+                best_iou = v;
+            }
+        }
+        if (best >= 0)
+        {
+            used[best] = true;
+            matched++;
+        }
+    }
+    return matched;
+}
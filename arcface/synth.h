@@ -0,0 +1,51 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <vector>
+#include <string>
+#include "base.h"
+#include "mtcnn.h"
+
+using namespace std;
+
+// Synthetic frames for scaling benchmarks: faces cut from real photos pasted
+// at controlled sizes and counts onto a background of any resolution, with
+// the pasted boxes and landmarks as ground truth.
+
+// packed BGR pixels around a face, and the face in their coordinates
+struct FaceSource {
+    vector<unsigned char> pixels;
+    int w = 0;
+    int h = 0;
+    FaceInfo face;
+};
+
+// the most confident face of each JPEG with half its size of margin around
+// it. files that do not decode or have no face are skipped
+vector<FaceSource> loadFaceSources(MtcnnDetector& detector, const vector<string>& paths);
+
+struct FrameSpec {
+    int width = 640;
+    int height = 480;
+    int faces = 1;
+    // sides of the face boxes in pixels, drawn log-uniformly
+    int min_face = 40;
+    int max_face = 160;
+    unsigned int seed = 1;
+};
+
+// packed BGR pixels of a width x height frame: a textured background with
+// the faces pasted at random places, cut from the sources in turn. pasted
+// regions do not overlap, so fewer faces than asked for are placed when they
+// do not fit. truth receives the faces that were placed
+vector<unsigned char> composeFrame(const vector<FaceSource>& sources, const FrameSpec& spec, vector<FaceInfo>& truth);
+
+// "640x480,1920x1080" and "1,4,16". return false on a malformed list
+bool parseSizeList(const string& text, vector<pair<int, int> >& sizes);
+bool parseIntList(const string& text, vector<int>& values);
+
+// the number of truth faces that a detection overlaps with at least min_iou,
+// each detection counted for one face only
+int matchFaces(const vector<FaceInfo>& truth, const vector<FaceInfo>& found, float min_iou = 0.5f);
+
+#endif